@@ -0,0 +1,49 @@
+/*
+ * Benchmark for finding NAMs in repetitive sequence
+ *
+ * A query from a tandem repeat has a hit at every copy of the repeat unit in
+ * the reference, and each copy leaves a NAM open. This measures how the
+ * time for finding NAMs scales with the number of copies.
+ *
+ * Usage: bench_nams [query length] [repeat unit length]
+ */
+#include <iostream>
+#include <random>
+#include <string>
+#include "index.hpp"
+#include "indexparameters.hpp"
+#include "nam.hpp"
+#include "randstrobes.hpp"
+#include "refs.hpp"
+#include "timer.hpp"
+
+int main(int argc, char** argv) {
+    size_t query_length = argc > 1 ? std::stoul(argv[1]) : 1000;
+    size_t unit_length = argc > 2 ? std::stoul(argv[2]) : 50;
+
+    std::mt19937 rng(42);
+    std::string unit;
+    for (size_t i = 0; i < unit_length; ++i) {
+        unit.push_back("ACGT"[rng() % 4]);
+    }
+
+    // No filtering so that all hits are processed
+    IndexParameters parameters(20, 16, 0, 7, 255, 1'000'000'000);
+
+    std::cout << "ref_length\tnams\ttime_s" << std::endl;
+    for (size_t ref_length = 12'500; ref_length <= 400'000; ref_length *= 2) {
+        std::string ref_seq;
+        while (ref_seq.size() < ref_length) {
+            ref_seq += unit;
+        }
+        References references({ref_seq}, {"tandem"});
+        StrobemerIndex index(references, parameters);
+        index.populate(parameters.filter_cutoff, 1);
+
+        std::string query = ref_seq.substr(0, query_length);
+        auto query_randstrobes = randstrobes_query(parameters.k, parameters.w_min, parameters.w_max, query, parameters.s, parameters.t_syncmer, parameters.max_dist);
+        Timer timer;
+        auto [nonrepetitive_fraction, nams] = find_nams(query_randstrobes, index);
+        std::cout << ref_length << '\t' << nams.size() << '\t' << timer.elapsed() << std::endl;
+    }
+}
@@ -0,0 +1,90 @@
+/*
+ * Benchmark for writing NAMs as text
+ *
+ * Compares output_nams with the previous implementation, which built each
+ * line by concatenating temporary strings. Both are run on the same random
+ * NAMs, and their output is checked to be identical.
+ *
+ * Usage: bench_output [number of queries] [NAMs per query]
+ */
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "nam.hpp"
+#include "output.hpp"
+#include "refs.hpp"
+#include "timer.hpp"
+
+namespace {
+
+void output_nams_concatenated(std::string &nam_output, const std::vector<Nam> &nams, std::string_view query_name, const References& references) {
+    nam_output.append("> ");
+    nam_output.append(query_name);
+    nam_output.append("\n");
+    for (auto n: nams ){
+        if (!n.is_rc){
+            nam_output.append("  " + references.names[n.ref_id]  + " " + std::to_string(n.ref_s+1)  + " " + std::to_string(n.query_s+1) + " " + std::to_string(n.ref_e - n.ref_s) + "\n");
+        }
+    }
+    nam_output.append("> ");
+    nam_output.append(query_name);
+    nam_output.append(" Reverse\n");
+    for (auto n: nams ){
+        if (n.is_rc){
+            nam_output.append("  " + references.names[n.ref_id]  + " " + std::to_string(n.ref_s+1)  + " " + std::to_string(n.query_s+1) + " " + std::to_string(n.ref_e - n.ref_s) + "\n");
+        }
+    }
+}
+
+template <typename F>
+double run(F output, std::string& out, const std::vector<std::vector<Nam>>& queries, const std::vector<std::string>& query_names, const References& references) {
+    out.clear();
+    Timer timer;
+    for (size_t i = 0; i < queries.size(); ++i) {
+        output(out, queries[i], query_names[i], references);
+    }
+    return timer.elapsed();
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    size_t n_queries = argc > 1 ? std::stoul(argv[1]) : 100'000;
+    size_t nams_per_query = argc > 2 ? std::stoul(argv[2]) : 20;
+
+    std::mt19937 rng(42);
+    std::vector<std::string> sequences;
+    std::vector<std::string> names;
+    for (int i = 0; i < 25; ++i) {
+        sequences.push_back("ACGT");
+        names.push_back("chromosome_" + std::to_string(i + 1));
+    }
+    References references(std::move(sequences), std::move(names));
+
+    std::vector<std::vector<Nam>> queries(n_queries);
+    std::vector<std::string> query_names;
+    for (size_t i = 0; i < n_queries; ++i) {
+        query_names.push_back("read_" + std::to_string(i) + "/1");
+        for (size_t j = 0; j < nams_per_query; ++j) {
+            Nam nam;
+            nam.ref_id = rng() % references.size();
+            nam.ref_s = rng() % 200'000'000;
+            nam.ref_e = nam.ref_s + 20 + rng() % 200;
+            nam.query_s = rng() % 10'000;
+            nam.is_rc = rng() % 2;
+            queries[i].push_back(nam);
+        }
+    }
+
+    std::string expected, out;
+    double concatenated = run(output_nams_concatenated, expected, queries, query_names, references);
+    double to_chars = run(output_nams, out, queries, query_names, references);
+    if (out != expected) {
+        std::cerr << "Output differs between implementations" << std::endl;
+        return 1;
+    }
+    std::cout << "implementation\ttime_s\tMB_per_s" << std::endl;
+    std::cout << "concatenated\t" << concatenated << '\t' << out.size() / concatenated / 1e6 << std::endl;
+    std::cout << "to_chars\t" << to_chars << '\t' << out.size() / to_chars / 1e6 << std::endl;
+}
@@ -82,26 +82,35 @@ static inline bool compareByQueryCoord(const Nam &a, const Nam &b)
 }
 
 
-void align_SE_read(
-    const KSeq &record,
-    std::string &outstring,
+void find_read_nams(
+    const ReadRecord &record,
     AlignmentStatistics &statistics,
     const mapping_params &map_param,
     const IndexParameters& index_parameters,
-    const References& references,
-    const StrobemerIndex& index
+    const StrobemerIndex& index,
+    QueryBuffers& buffers
 ) {
-    Timer strobe_timer;
-    auto query_randstrobes = randstrobes_query(index_parameters.k, index_parameters.w_min, index_parameters.w_max, record.seq, index_parameters.s, index_parameters.t_syncmer, index_parameters.max_dist);
-    statistics.tot_construct_strobemers += strobe_timer.duration();
+    float nonrepetitive_fraction;
+    std::vector<Nam>& nams = buffers.nams;
+    if (map_param.query_window > 0 && record.seq.length() >= 2 * size_t(map_param.query_window)) {
+        // Long queries are split into windows that are processed in parallel
+        Timer nam_timer;
+        std::tie(nonrepetitive_fraction, nams) = find_nams_windowed(record.seq, index_parameters, index, map_param.query_window, map_param.diagonal_band_width, map_param.n_threads);
+        statistics.tot_find_nams += nam_timer.duration();
+    } else {
+        Timer strobe_timer;
+        auto& query_randstrobes = buffers.query_randstrobes;
+        randstrobes_query(index_parameters.k, index_parameters.w_min, index_parameters.w_max, record.seq, index_parameters.s, index_parameters.t_syncmer, index_parameters.max_dist, query_randstrobes, buffers.string_hashes, buffers.pos_to_seq_coordinate);
+        statistics.tot_construct_strobemers += strobe_timer.duration();
 
-    // Find NAMs
-    Timer nam_timer;
+        // Find NAMs
+        Timer nam_timer;
 
-//    logger.debug() << "index_parameters.filter_cutoff: " << std::to_string(index_parameters.filter_cutoff)  << "index.filter_cutoff: " << std::to_string(index.filter_cutoff) << std::endl;
+//        logger.debug() << "index_parameters.filter_cutoff: " << std::to_string(index_parameters.filter_cutoff)  << "index.filter_cutoff: " << std::to_string(index.filter_cutoff) << std::endl;
 
-    auto [nonrepetitive_fraction, nams] = find_nams(query_randstrobes, index);
-    statistics.tot_find_nams += nam_timer.duration();
+        nonrepetitive_fraction = find_nams(query_randstrobes, index, buffers, map_param.diagonal_band_width, map_param.n_threads);
+        statistics.tot_find_nams += nam_timer.duration();
+    }
 
 //    if (map_param.R > 1) {
 //        Timer rescue_timer;
@@ -117,16 +126,30 @@ void align_SE_read(
     statistics.tot_sort_nams += nam_sort_timer.duration();
 
     // Take first L NAMs for output
-    unsigned int cut_nam_vec_at = (map_param.L < nams.size()) ? map_param.L : nams.size();
-    std::vector<Nam> nams_cut(nams.begin(), nams.begin() + cut_nam_vec_at);
+    if (size_t(map_param.L) < nams.size()) {
+        nams.resize(map_param.L);
+    }
 
     //Sort hits based on start choordinate on query sequence
     if (!map_param.sort_on_scores) {
 //        logger.debug() << "Sorting output on scores. sort_on_scores: " << std::endl;
-        std::sort(nams_cut.begin(), nams_cut.end(), compareByQueryCoord);
+        std::sort(nams.begin(), nams.end(), compareByQueryCoord);
     }
 
-    output_nams(outstring, nams_cut, record.name, references);
+}
+
+void align_SE_read(
+    const ReadRecord &record,
+    std::string &outstring,
+    AlignmentStatistics &statistics,
+    const mapping_params &map_param,
+    const IndexParameters& index_parameters,
+    const References& references,
+    const StrobemerIndex& index,
+    QueryBuffers& buffers
+) {
+    find_read_nams(record, statistics, map_param, index_parameters, index, buffers);
+    output_nams(outstring, buffers.nams, record.name, references);
 //    output_hits_paf(outstring, nams, record.name, references, index_parameters.k,
 //                        record.seq.length());
 
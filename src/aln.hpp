@@ -6,6 +6,8 @@
 #include "kseq++.hpp"
 #include "index.hpp"
 #include "refs.hpp"
+#include "nam.hpp"
+#include "readbatch.hpp"
 //#include "aligner.hpp"
 
 struct AlignmentStatistics {
@@ -50,6 +52,11 @@ struct mapping_params {
     int L { 1000 };
     int C { 1000 };
     bool sort_on_scores { false };
+    int diagonal_band_width { 0 };
+    int query_window { 0 };
+    int n_threads { 1 };
+    bool binary_output { false };
+    bool compress_output { false };
 
 };
 
@@ -79,14 +86,26 @@ struct mapping_params {
 //    const StrobemerIndex& index
 //);
 
+// Find the NAMs of a read and leave them in buffers.nams, sorted for output
+// and cut to at most L
+void find_read_nams(
+    const ReadRecord& record,
+    AlignmentStatistics &statistics,
+    const mapping_params& map_param,
+    const IndexParameters& index_parameters,
+    const StrobemerIndex& index,
+    QueryBuffers& buffers
+);
+
 void align_SE_read(
-    const klibpp::KSeq& record,
+    const ReadRecord& record,
     std::string& outstring,
     AlignmentStatistics &statistics,
     const mapping_params& map_param,
     const IndexParameters& index_parameters,
     const References& references,
-    const StrobemerIndex& index
+    const StrobemerIndex& index,
+    QueryBuffers& buffers
 );
 
 // Private declarations, only here because we need them in tests
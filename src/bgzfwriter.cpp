@@ -0,0 +1,97 @@
+#include "bgzfwriter.hpp"
+
+#include <stdexcept>
+
+namespace {
+
+// Uncompressed data per block. Even incompressible data then fits into the
+// 64 KiB limit of a block when it is stored without compression.
+const size_t BGZF_BLOCK_DATA_SIZE = 0xff00;
+
+const size_t BGZF_HEADER_SIZE = 18;
+const size_t BGZF_FOOTER_SIZE = 8;
+const size_t BGZF_MAX_BLOCK_SIZE = 65536;
+
+const unsigned char BGZF_HEADER[BGZF_HEADER_SIZE] = {
+    0x1f, 0x8b, 8, 4,  // gzip magic, deflate, FEXTRA
+    0, 0, 0, 0,  // mtime
+    0, 0xff,  // extra flags, OS unknown
+    6, 0,  // XLEN
+    'B', 'C', 2, 0,  // BGZF subfield with a 2-byte payload
+    0, 0  // BSIZE (total block size minus one), filled in per block
+};
+
+const char BGZF_EOF[28] = {
+    0x1f, char(0x8b), 8, 4, 0, 0, 0, 0, 0, char(0xff), 6, 0, 'B', 'C', 2, 0,
+    0x1b, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0
+};
+
+void append_le32(std::string& out, uint32_t value) {
+    for (int i = 0; i < 4; ++i) {
+        out.push_back(char((value >> (8 * i)) & 0xff));
+    }
+}
+
+} // namespace
+
+BgzfCompressor::BgzfCompressor(int level) : level(level) {
+    strm.zalloc = Z_NULL;
+    strm.zfree = Z_NULL;
+    strm.opaque = Z_NULL;
+    if (deflateInit2(&strm, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw std::runtime_error("Could not initialize zlib");
+    }
+}
+
+BgzfCompressor::~BgzfCompressor() {
+    deflateEnd(&strm);
+}
+
+void BgzfCompressor::compress(std::string& out, std::string_view data) {
+    out.reserve(out.size() + data.size() / 2);
+    for (size_t start = 0; start < data.size(); start += BGZF_BLOCK_DATA_SIZE) {
+        compress_block(out, data.substr(start, BGZF_BLOCK_DATA_SIZE));
+    }
+}
+
+void BgzfCompressor::compress_block(std::string& out, std::string_view data) {
+    size_t block_start = out.size();
+    out.append(reinterpret_cast<const char*>(BGZF_HEADER), BGZF_HEADER_SIZE);
+    size_t max_compressed = BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+    out.resize(block_start + BGZF_HEADER_SIZE + max_compressed);
+
+    deflateReset(&strm);
+    strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    strm.avail_in = data.size();
+    strm.next_out = reinterpret_cast<Bytef*>(&out[block_start + BGZF_HEADER_SIZE]);
+    strm.avail_out = max_compressed;
+    int ret = deflate(&strm, Z_FINISH);
+    if (ret != Z_STREAM_END) {
+        // Did not fit (incompressible data); store the block uncompressed
+        deflateReset(&strm);
+        deflateParams(&strm, Z_NO_COMPRESSION, Z_DEFAULT_STRATEGY);
+        strm.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+        strm.avail_in = data.size();
+        strm.next_out = reinterpret_cast<Bytef*>(&out[block_start + BGZF_HEADER_SIZE]);
+        strm.avail_out = max_compressed;
+        ret = deflate(&strm, Z_FINISH);
+        deflateReset(&strm);
+        deflateParams(&strm, level, Z_DEFAULT_STRATEGY);
+        if (ret != Z_STREAM_END) {
+            throw std::runtime_error("Could not compress BGZF block");
+        }
+    }
+    out.resize(block_start + BGZF_HEADER_SIZE + (max_compressed - strm.avail_out));
+
+    uint32_t crc = crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<const Bytef*>(data.data()), data.size());
+    append_le32(out, crc);
+    append_le32(out, data.size());
+
+    size_t bsize = out.size() - block_start - 1;
+    out[block_start + 16] = char(bsize & 0xff);
+    out[block_start + 17] = char(bsize >> 8);
+}
+
+std::string_view bgzf_eof_block() {
+    return std::string_view(BGZF_EOF, sizeof(BGZF_EOF));
+}
@@ -0,0 +1,37 @@
+#ifndef BGZFWRITER_HPP
+#define BGZFWRITER_HPP
+
+#include <string>
+#include <string_view>
+#include <zlib.h>
+
+/*
+ * Compresses data into BGZF blocks: independent gzip members of at most
+ * 64 KiB with the block size in an extra header field. Concatenated blocks
+ * form a valid gzip file, and since each block is compressed on its own,
+ * separate parts of the output can be compressed on different threads.
+ *
+ * A compressor keeps its zlib state between calls, so each thread should
+ * own one.
+ */
+class BgzfCompressor {
+public:
+    explicit BgzfCompressor(int level = Z_DEFAULT_COMPRESSION);
+    ~BgzfCompressor();
+    BgzfCompressor(const BgzfCompressor&) = delete;
+    BgzfCompressor& operator=(const BgzfCompressor&) = delete;
+
+    // Append data to out as one or more BGZF blocks
+    void compress(std::string& out, std::string_view data);
+
+private:
+    void compress_block(std::string& out, std::string_view data);
+
+    int level;
+    z_stream strm;
+};
+
+// The empty block that marks the end of a BGZF file
+std::string_view bgzf_eof_block();
+
+#endif
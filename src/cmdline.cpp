@@ -6,13 +6,45 @@
 
 class Version {};
 
+/*
+ * Parse a size such as "500M" (suffixes K, M and G are powers of 1024).
+ * Return 0 if the string is not a valid size.
+ */
+static size_t parse_size(const std::string& s) {
+    size_t end;
+    size_t value;
+    try {
+        value = std::stoull(s, &end);
+    } catch (const std::logic_error&) {
+        return 0;
+    }
+    if (end == s.length()) {
+        return value;
+    }
+    if (end + 1 != s.length()) {
+        return 0;
+    }
+    switch (std::toupper(s[end])) {
+        case 'G': value *= 1024; // fall through
+        case 'M': value *= 1024; // fall through
+        case 'K': value *= 1024; return value;
+        default: return 0;
+    }
+}
+
 CommandLineOptions parse_command_line_arguments(int argc, char **argv) {
+    // "namfinder serve" takes the same options as a normal run
+    bool serve = argc > 1 && std::string(argv[1]) == "serve";
+    if (serve) {
+        argc--;
+        argv++;
+    }
 
     args::ArgumentParser parser("namfinder " + version_string());
     parser.helpParams.showTerminator = false;
     parser.helpParams.helpindent = 20;
     parser.helpParams.width = 90;
-    parser.helpParams.programName = "namfinder";
+    parser.helpParams.programName = serve ? "namfinder serve" : "namfinder";
     parser.helpParams.shortSeparator = " ";
 
     args::HelpFlag help(parser, "help", "Print help and exit", {'h', "help"});
@@ -24,13 +56,20 @@ CommandLineOptions parse_command_line_arguments(int argc, char **argv) {
 
     args::Group io(parser, "Input/output:");
     args::ValueFlag<std::string> o(parser, "PATH", "redirect output to file [stdout]", {'o'});
+    args::Flag unordered(parser, "unordered", "Write the NAMs of each chunk of reads as soon as it is done instead of in input order", {"unordered"});
+    args::Flag binary(parser, "binary", "Write NAMs in a compact binary format. Use 'namfinder view' to convert it to text or PAF", {"binary"});
+    args::ValueFlag<std::string> socket(parser, "PATH", "With 'namfinder serve', listen for queries on the Unix socket PATH [namfinder.sock]", {"socket"});
     args::Flag v(parser, "v", "Verbose output", {'v'});
     args::Flag S(parser, "S", "Sort output NAMs for each query based on score. Default is to sort first by ref ID, then by query coordinate, then by reference coordinate.", {'S'});
 
     args::ValueFlag<int> N(parser, "INT", "Retain at most INT secondary alignments (is upper bounded by -M and depends on -S) [0]", {'N'});
     args::ValueFlag<std::string> index_statistics(parser, "PATH", "Print statistics of indexing to PATH", {"index-statistics"});
-    args::Flag i(parser, "index", "Do not map reads; only generate the strobemer index and write it to disk. If read files are provided, they are used to estimate read length", {"create-index", 'i'});
-    args::Flag use_index(parser, "use_index", "Use a pre-generated index previously written with --create-index.", { "use-index" });
+    args::Flag i(parser, "index", "Do not find NAMs; only generate the strobemer index and write it to disk as REFERENCE.sti", {"create-index", 'i'});
+    args::Flag use_index(parser, "use_index", "Use a pre-generated index previously written with --create-index. The index is memory-mapped instead of being read into memory.", { "use-index" });
+    args::ValueFlag<std::string> shared_index(parser, "NAME", "Share the index with other namfinder processes on this machine. The first process builds it into the POSIX shared memory object NAME (in /dev/shm), or into the file NAME if it contains a slash (for example on a hugetlbfs mount). Later processes map it read-only and do not read the reference FASTA. The object is not removed when the processes end.", {"shared-index"});
+    args::ValueFlag<std::string> build_memory(parser, "SIZE", "Use at most about SIZE bytes of memory for building the index (K, M and G suffixes allowed). If more would be needed, sorted parts of the index are written to temporary files and merged [no limit]", {"build-memory"});
+
+    args::Flag drop_repetitive(parser, "drop_repetitive", "Store only a single entry in the index for randstrobes that occur more than C times in the reference. They are never used for finding NAMs, so this only makes the index smaller.", {"drop-repetitive"});
 
     args::Group seeding_group(parser, "Seeding:");
     auto seeding = SeedingArguments{parser};
@@ -38,8 +77,12 @@ CommandLineOptions parse_command_line_arguments(int argc, char **argv) {
     args::Group search(parser, "Search parameters:");
 
     args::ValueFlag<int> C(parser, "INT", "Mask (do not process) strobemer hits with count larger than C [1000]", {'C'});
+    args::ValueFlag<float> filter_fraction(parser, "FLOAT", "Instead of using a fixed C, choose it such that the top FLOAT fraction of distinct randstrobes (by number of occurrences in the reference) are masked, for example 0.0002", {"filter-fraction"});
     args::ValueFlag<int> L(parser, "INT", "Print at most L NAMs per query [1000]. Will print the NAMs with highest score S = n_strobemer_hits * query_span.", {'L'});
 
+    args::ValueFlag<int> diagonal_band(parser, "INT", "Merge hits into NAMs separately for each strand and diagonal band of width INT (diagonal = reference start - query start). Bands of queries with many hits are merged in parallel. NAMs do not extend across band boundaries [0: off]", {"diagonal-band"});
+    args::ValueFlag<int> query_window(parser, "INT", "Split queries of at least twice this length into windows of about INT nucleotides whose NAMs are found in parallel and then joined [250000; 0: off]", {"query-window"});
+
     args::Positional<std::string> ref_filename(parser, "reference", "Reference in FASTA format", args::Options::Required);
     args::Positional<std::string> reads1_filename(parser, "reads1", "Reads 1 in FASTA or FASTQ format, optionally gzip compressed");
     args::Positional<std::string> reads2_filename(parser, "reads2", "Reads 2 in FASTA or FASTQ format, optionally gzip compressed");
@@ -74,10 +117,45 @@ CommandLineOptions parse_command_line_arguments(int argc, char **argv) {
     // Input/output
     if (o) { opt.output_file_name = args::get(o); opt.write_to_stdout = false; }
     if (S) {opt.sort_on_scores = true;}
+    if (unordered) { opt.unordered_output = true; }
+    if (binary) { opt.binary_output = true; }
+    if (serve) {
+        opt.serve = true;
+        if (o || reads1_filename || i) {
+            std::cerr << "Error: 'namfinder serve' takes only a reference and does not accept -o or --create-index" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (socket) {
+        if (!serve) {
+            std::cerr << "Error: --socket can only be used with 'namfinder serve'" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        opt.socket_path = args::get(socket);
+    }
 
     if (index_statistics) { opt.logfile_name = args::get(index_statistics); }
-//    if (i) { opt.only_gen_index = true; }
+    if (i) { opt.only_gen_index = true; }
     if (use_index) { opt.use_index = true; }
+    if (build_memory) {
+        opt.build_memory = parse_size(args::get(build_memory));
+        if (opt.build_memory == 0) {
+            std::cerr << "Error: Invalid size for --build-memory: " << args::get(build_memory) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (drop_repetitive) { opt.drop_repetitive = true; }
+    if (shared_index) {
+        opt.shared_index = args::get(shared_index);
+        if (opt.shared_index.empty() || opt.only_gen_index || opt.use_index) {
+            std::cerr << "Error: --shared-index needs a name and cannot be used with --create-index or --use-index" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (opt.only_gen_index && opt.use_index) {
+        std::cerr << "Error: --create-index and --use-index cannot be used together" << std::endl;
+        exit(EXIT_FAILURE);
+    }
 
     // Seeding
     if (seeding.k) { opt.k = args::get(seeding.k); opt.k_set = true; }
@@ -91,7 +169,32 @@ CommandLineOptions parse_command_line_arguments(int argc, char **argv) {
 
 
     if (C) { opt.filter_cutoff = args::get(C); }
+    if (filter_fraction) {
+        opt.filter_fraction = args::get(filter_fraction);
+        if (opt.filter_fraction <= 0 || opt.filter_fraction >= 1) {
+            std::cerr << "Error: --filter-fraction must be between 0 and 1" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (C) {
+            std::cerr << "Error: -C and --filter-fraction cannot be used together" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
     if (L) { opt.L = args::get(L); }
+    if (diagonal_band) {
+        opt.diagonal_band_width = args::get(diagonal_band);
+        if (opt.diagonal_band_width < 0) {
+            std::cerr << "Error: --diagonal-band must not be negative" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (query_window) {
+        opt.query_window = args::get(query_window);
+        if (opt.query_window < 0) {
+            std::cerr << "Error: --query-window must not be negative" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
 
     // Reference and read files
     opt.ref_filename = args::get(ref_filename);
@@ -104,3 +207,36 @@ CommandLineOptions parse_command_line_arguments(int argc, char **argv) {
 
     return opt;
 }
+
+ViewOptions parse_view_arguments(int argc, char **argv) {
+    args::ArgumentParser parser("Convert binary NAM output written with --binary to text");
+    parser.helpParams.showTerminator = false;
+    parser.helpParams.helpindent = 20;
+    parser.helpParams.width = 90;
+    parser.helpParams.programName = "namfinder view";
+    parser.helpParams.shortSeparator = " ";
+
+    args::HelpFlag help(parser, "help", "Print help and exit", {'h', "help"});
+    args::ValueFlag<std::string> o(parser, "PATH", "redirect output to file [stdout]", {'o'});
+    args::Flag paf(parser, "paf", "Write PAF instead of the default NAM text format", {"paf"});
+    args::Positional<std::string> input_filename(parser, "nams", "Binary NAM file", args::Options::Required);
+
+    try {
+        parser.ParseCLI(argc, argv);
+    }
+    catch (const args::Help&) {
+        std::cout << parser;
+        exit(EXIT_SUCCESS);
+    }
+    catch (const args::Error& e) {
+        std::cerr << parser;
+        std::cerr << "Error: " << e.what() << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    ViewOptions opt;
+    opt.input_file_name = args::get(input_filename);
+    if (o) { opt.output_file_name = args::get(o); opt.write_to_stdout = false; }
+    if (paf) { opt.paf = true; }
+    return opt;
+}
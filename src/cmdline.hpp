@@ -12,8 +12,16 @@ struct CommandLineOptions {
     // Input/output
     std::string output_file_name;
     bool write_to_stdout { true };
+    bool unordered_output { false };
+    bool binary_output { false };
+    bool serve { false };
+    std::string socket_path { "namfinder.sock" };
     std::string logfile_name { "" };
+    bool only_gen_index { false };
     bool use_index { false };
+    std::string shared_index;
+    size_t build_memory { 0 };
+    bool drop_repetitive { false };
     bool sort_on_scores{false};
 
     // Seeding
@@ -31,8 +39,11 @@ struct CommandLineOptions {
     int max_seed_len {255};
 
     int L { 1000 };
+    int diagonal_band_width { 0 };
+    int query_window { 250000 };
     int C { 1000 };
     int filter_cutoff {1000};
+    float filter_fraction { 0 };
 
     // Reference and read files
     std::string ref_filename; // This is either a fasta file or an index file - if fasta, indexing will be run
@@ -44,4 +55,14 @@ struct CommandLineOptions {
 
 CommandLineOptions parse_command_line_arguments(int argc, char **argv);
 
+// Options of the "namfinder view" subcommand
+struct ViewOptions {
+    std::string input_file_name;
+    std::string output_file_name;
+    bool write_to_stdout { true };
+    bool paf { false };
+};
+
+ViewOptions parse_view_arguments(int argc, char **argv);
+
 #endif
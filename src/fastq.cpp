@@ -1,20 +1,19 @@
 #include "fastq.hpp"
 
-RewindableFile::RewindableFile(const std::string& filename)
+RewindableFile::RewindableFile(const std::string& filename, size_t n_threads)
     : file(nullptr),
     rewindable(true),
     stream_(klibpp::make_ikstream(this, rewind_read, 16384)) {
     if (filename != "") {
-        file = gzopen(filename.c_str(), "r");
-        if (file == nullptr) {
-            throw InvalidFile("Could not open FASTQ file: " + filename);
-        }
+        file = std::make_unique<GzipReader>(filename, n_threads);
     }
     stream_ = klibpp::make_ikstream(this, rewind_read, 16384);
 }
 
-RewindableFile::~RewindableFile() {
-    if (file) gzclose(file);
+RewindableFile::RewindableFile(std::unique_ptr<GzipReader> file)
+    : file(std::move(file)),
+    rewindable(true),
+    stream_(klibpp::make_ikstream(this, rewind_read, 16384)) {
 }
 
 void RewindableFile::rewind() {
@@ -41,10 +40,7 @@ int RewindableFile::read(void* buffer, const int length) {
         return can_read +
             this->read(static_cast<char*>(buffer) + can_read, length - can_read);
     }
-    const int bytes_read = gzread(file, buffer, length);
-    if (bytes_read < 0) {
-        throw std::runtime_error("Error reading FASTQ file");
-    }
+    const int bytes_read = file->read(static_cast<char*>(buffer), length);
     if (rewindable) {
         saved_buffer.push_back(std::vector<unsigned char>(
                     static_cast<unsigned char*>(buffer),
@@ -54,12 +50,17 @@ int RewindableFile::read(void* buffer, const int length) {
 }
 
 int rewind_read(RewindableFile* file, void* buffer, unsigned int length) {
-    return file->read(buffer, length);
+    try {
+        return file->read(buffer, length);
+    } catch (...) {
+        file->set_error(std::current_exception());
+        return -1;
+    }
 }
 
-input_stream_t open_fastq(std::string& filename) {
+input_stream_t open_fastq(std::string& filename, size_t n_threads) {
     if (filename == "-") {
         filename = "/dev/stdin";
     }
-    return std::unique_ptr<RewindableFile>(new RewindableFile(filename));
+    return std::unique_ptr<RewindableFile>(new RewindableFile(filename, n_threads));
 }
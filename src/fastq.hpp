@@ -1,10 +1,12 @@
 #ifndef FASTQ_HPP
 #define FASTQ_HPP
 
-#include <zlib.h>
+#include <exception>
+#include <memory>
 #include <string>
 
 #include "exceptions.hpp"
+#include "gzipreader.hpp"
 #include "kseq++.hpp"
 
 // File that can be rewound (once only!)
@@ -12,28 +14,39 @@ class RewindableFile {
 
 public:
     typedef klibpp::KStream<RewindableFile*, int (*)(RewindableFile*, void*, unsigned int), klibpp::mode::In_> stream_type;
-    // if filename == "", then the result is a null file (i.e., every read fails)
-    explicit RewindableFile(const std::string& filename);
-    ~RewindableFile();
+    // if filename == "", then the result is a null file (i.e., every read fails).
+    // Compressed input is decompressed on up to n_threads background threads.
+    explicit RewindableFile(const std::string& filename, size_t n_threads = 1);
+    explicit RewindableFile(std::unique_ptr<GzipReader> file);
 
     stream_type& stream() { return stream_; }
     int read(void* buffer, int length);
 
+    // The kseq++ parser cannot pass on exceptions, so read() reports errors
+    // by returning -1. This rethrows the exception that caused it, if any.
+    void check_error() const {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+    void set_error(std::exception_ptr e) { error = e; }
+
     // Reset to the beginning of the file. Can only be called once!
     void rewind();
 
 protected:
-    gzFile file;
+    std::unique_ptr<GzipReader> file;
     std::vector<std::vector<unsigned char>> saved_buffer;
     // if rewindable is false, the file cannot be rewound anymore and is consuming from saved_buffer (if it is not empty)
     bool rewindable;
     stream_type stream_;
+    std::exception_ptr error;
 };
 
 int rewind_read(RewindableFile* file, void* buffer, unsigned int length);
 
 typedef std::unique_ptr<RewindableFile> input_stream_t;
 
-input_stream_t open_fastq(std::string& filename);
+input_stream_t open_fastq(std::string& filename, size_t n_threads = 1);
 
 #endif
@@ -0,0 +1,377 @@
+#include "gzipreader.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <zlib.h>
+#include "exceptions.hpp"
+
+namespace {
+
+// Target size of the decompressed data of a slot for plain input
+const size_t SLOT_SIZE = 1 << 20;
+
+// Target size of the compressed blocks of a slot for BGZF input
+const size_t BGZF_SLOT_COMPRESSED_SIZE = 1 << 19;
+
+uint32_t read_le32(const unsigned char* p) {
+    return uint32_t(p[0]) | uint32_t(p[1]) << 8 | uint32_t(p[2]) << 16 | uint32_t(p[3]) << 24;
+}
+
+uint16_t read_le16(const unsigned char* p) {
+    return uint16_t(p[0]) | uint16_t(p[1]) << 8;
+}
+
+/*
+ * Return the BSIZE field (total block size minus one) of a BGZF block given
+ * the extra field of its header, or -1 if there is none.
+ */
+int bgzf_block_size(const unsigned char* extra, size_t xlen) {
+    size_t i = 0;
+    while (i + 4 <= xlen) {
+        uint16_t slen = read_le16(extra + i + 2);
+        if (extra[i] == 'B' && extra[i + 1] == 'C' && slen == 2 && i + 6 <= xlen) {
+            return read_le16(extra + i + 4);
+        }
+        i += 4 + slen;
+    }
+    return -1;
+}
+
+bool is_gzip_header(const unsigned char* p, size_t n) {
+    return n >= 2 && p[0] == 0x1f && p[1] == 0x8b;
+}
+
+bool is_bgzf_header(const unsigned char* p, size_t n) {
+    if (n < 18 || !is_gzip_header(p, n) || p[2] != 8 || !(p[3] & 4)) {
+        return false;
+    }
+    size_t xlen = read_le16(p + 10);
+    return bgzf_block_size(p + 12, std::min(xlen, n - 12)) >= 0;
+}
+
+std::FILE* open_file(const std::string& filename) {
+    std::FILE* file = std::fopen(filename.c_str(), "rb");
+    if (file == nullptr) {
+        throw InvalidFile("Could not open " + filename + ": " + std::strerror(errno));
+    }
+    return file;
+}
+
+} // namespace
+
+GzipReader::GzipReader(const std::string& filename, size_t n_threads)
+    : GzipReader(open_file(filename), filename, n_threads) {
+}
+
+GzipReader::GzipReader(std::FILE* file, const std::string& name, size_t n_threads)
+    : filename(name), file(file) {
+    // Detect the format from the first bytes. They are kept in pending and
+    // passed on to the thread that reads the file.
+    pending.resize(18);
+    pending.resize(std::fread(pending.data(), 1, pending.size(), file));
+    bgzf = is_bgzf_header(pending.data(), pending.size());
+
+    if (bgzf) {
+        n_threads = std::max(n_threads, size_t(1));
+        slots.resize(2 * n_threads + 2);
+        threads.emplace_back(&GzipReader::read_bgzf_blocks, this);
+        for (size_t i = 0; i < n_threads; ++i) {
+            threads.emplace_back(&GzipReader::inflate_bgzf_blocks, this);
+        }
+    } else {
+        slots.resize(4);
+        if (is_gzip_header(pending.data(), pending.size())) {
+            threads.emplace_back(&GzipReader::inflate_gzip, this);
+        } else {
+            threads.emplace_back(&GzipReader::read_uncompressed, this);
+        }
+    }
+}
+
+GzipReader::~GzipReader() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        stopping = true;
+    }
+    cv.notify_all();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    std::fclose(file);
+}
+
+size_t GzipReader::read(char* buffer, size_t length) {
+    size_t total = 0;
+    while (total < length) {
+        std::unique_lock<std::mutex> lock(mtx);
+        Slot& slot = slots[n_read % slots.size()];
+        cv.wait(lock, [&] {
+            return error || slot.state == SlotState::Ready || (finished && n_read == n_filled);
+        });
+        if (error) {
+            std::rethrow_exception(error);
+        }
+        if (slot.state != SlotState::Ready) {
+            break;  // end of file
+        }
+        lock.unlock();
+
+        size_t n = std::min(length - total, slot.data.size() - read_pos);
+        std::memcpy(buffer + total, slot.data.data() + read_pos, n);
+        total += n;
+        read_pos += n;
+        if (read_pos == slot.data.size()) {
+            lock.lock();
+            slot.state = SlotState::Free;
+            n_read++;
+            read_pos = 0;
+            lock.unlock();
+            cv.notify_all();
+        }
+    }
+    return total;
+}
+
+/* Read from the file, starting with the bytes read for detecting the format */
+size_t GzipReader::read_input(unsigned char* buffer, size_t length) {
+    size_t n = std::min(length, pending.size() - pending_pos);
+    std::memcpy(buffer, pending.data() + pending_pos, n);
+    pending_pos += n;
+    if (n < length) {
+        n += std::fread(buffer + n, 1, length - n, file);
+        if (std::ferror(file)) {
+            throw InvalidFile("Error reading FASTQ file: " + filename);
+        }
+    }
+    return n;
+}
+
+void GzipReader::read_exactly(unsigned char* buffer, size_t length) {
+    if (read_input(buffer, length) != length) {
+        throw InvalidFile("Truncated BGZF file: " + filename);
+    }
+}
+
+// Wait until the slot for sequence number seq is free. Return false if the
+// reader is being stopped.
+bool GzipReader::wait_for_free_slot(size_t seq) {
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait(lock, [&] { return stopping || slots[seq % slots.size()].state == SlotState::Free; });
+    return !stopping;
+}
+
+void GzipReader::publish(size_t seq, SlotState state) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        slots[seq % slots.size()].state = state;
+        n_filled = seq + 1;
+    }
+    cv.notify_all();
+}
+
+void GzipReader::finish() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        finished = true;
+    }
+    cv.notify_all();
+}
+
+void GzipReader::fail(std::exception_ptr e) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        if (!error) {
+            error = e;
+        }
+        stopping = true;
+    }
+    cv.notify_all();
+}
+
+void GzipReader::read_uncompressed() {
+    try {
+        for (size_t seq = 0; wait_for_free_slot(seq); ++seq) {
+            Slot& slot = slots[seq % slots.size()];
+            slot.data.resize(SLOT_SIZE);
+            size_t n = read_input(reinterpret_cast<unsigned char*>(slot.data.data()), slot.data.size());
+            slot.data.resize(n);
+            if (n == 0) {
+                break;
+            }
+            publish(seq, SlotState::Ready);
+        }
+        finish();
+    } catch (...) {
+        fail(std::current_exception());
+    }
+}
+
+/*
+ * Inflate a gzip file, which may consist of multiple members, into the
+ * slots. As with gzread, data after the last member that is not gzip
+ * compressed is ignored.
+ */
+void GzipReader::inflate_gzip() {
+    z_stream strm{};
+    if (inflateInit2(&strm, 15 + 16) != Z_OK) {
+        fail(std::make_exception_ptr(std::runtime_error("Could not initialize zlib")));
+        return;
+    }
+    try {
+        std::vector<unsigned char> in(SLOT_SIZE / 4);
+        bool at_end = false;
+        bool in_member = false;
+        size_t n_members = 0;
+        for (size_t seq = 0; !at_end && wait_for_free_slot(seq); ++seq) {
+            Slot& slot = slots[seq % slots.size()];
+            slot.data.resize(SLOT_SIZE);
+            strm.next_out = reinterpret_cast<unsigned char*>(slot.data.data());
+            strm.avail_out = slot.data.size();
+            while (strm.avail_out > 0) {
+                if (strm.avail_in == 0) {
+                    size_t n = read_input(in.data(), in.size());
+                    if (n == 0) {
+                        if (in_member) {
+                            throw InvalidFile("Truncated gzip file: " + filename);
+                        }
+                        at_end = true;
+                        break;
+                    }
+                    strm.next_in = in.data();
+                    strm.avail_in = n;
+                }
+                in_member = true;
+                int ret = inflate(&strm, Z_NO_FLUSH);
+                if (ret == Z_STREAM_END) {
+                    // Another member may follow
+                    n_members++;
+                    in_member = false;
+                    inflateReset(&strm);
+                } else if (ret == Z_DATA_ERROR && n_members > 0 && strm.total_out == 0) {
+                    // Trailing data after the last member
+                    in_member = false;
+                    at_end = true;
+                    break;
+                } else if (ret != Z_OK) {
+                    throw InvalidFile("Error decompressing gzip file " + filename + ": " + (strm.msg ? strm.msg : "unknown error"));
+                }
+            }
+            slot.data.resize(slot.data.size() - strm.avail_out);
+            if (!slot.data.empty()) {
+                publish(seq, SlotState::Ready);
+            }
+        }
+        finish();
+    } catch (...) {
+        fail(std::current_exception());
+    }
+    inflateEnd(&strm);
+}
+
+/*
+ * Read groups of BGZF blocks into the slots. The blocks are inflated by the
+ * threads running inflate_bgzf_blocks.
+ */
+void GzipReader::read_bgzf_blocks() {
+    try {
+        bool at_end = false;
+        for (size_t seq = 0; !at_end && wait_for_free_slot(seq); ++seq) {
+            Slot& slot = slots[seq % slots.size()];
+            slot.compressed.clear();
+            slot.blocks.clear();
+            size_t data_size = 0;
+            while (slot.compressed.size() < BGZF_SLOT_COMPRESSED_SIZE) {
+                unsigned char header[12];
+                size_t n = read_input(header, sizeof(header));
+                if (n == 0) {
+                    at_end = true;
+                    break;
+                }
+                if (n < sizeof(header) || !is_gzip_header(header, n) || !(header[3] & 4)) {
+                    throw InvalidFile("Invalid BGZF block in " + filename);
+                }
+                size_t xlen = read_le16(header + 10);
+                size_t offset = slot.compressed.size();
+                slot.compressed.resize(offset + sizeof(header) + xlen);
+                std::memcpy(slot.compressed.data() + offset, header, sizeof(header));
+                read_exactly(slot.compressed.data() + offset + sizeof(header), xlen);
+                int bsize = bgzf_block_size(slot.compressed.data() + offset + sizeof(header), xlen);
+                size_t block_size = bsize + 1;
+                if (bsize < 0 || block_size < sizeof(header) + xlen + 8) {
+                    throw InvalidFile("Invalid BGZF block in " + filename);
+                }
+                slot.compressed.resize(offset + block_size);
+                read_exactly(slot.compressed.data() + offset + sizeof(header) + xlen, block_size - sizeof(header) - xlen);
+                slot.blocks.emplace_back(offset, data_size);
+                data_size += read_le32(slot.compressed.data() + offset + block_size - 4);
+            }
+            if (slot.blocks.empty()) {
+                break;
+            }
+            slot.blocks.emplace_back(slot.compressed.size(), data_size);
+            publish(seq, SlotState::Compressed);
+        }
+        finish();
+    } catch (...) {
+        fail(std::current_exception());
+    }
+}
+
+void GzipReader::inflate_bgzf_blocks() {
+    try {
+        while (true) {
+            std::unique_lock<std::mutex> lock(mtx);
+            cv.wait(lock, [&] { return stopping || n_inflated < n_filled || finished; });
+            if (stopping || n_inflated == n_filled) {
+                return;
+            }
+            size_t seq = n_inflated++;
+            lock.unlock();
+
+            Slot& slot = slots[seq % slots.size()];
+            inflate_bgzf_slot(slot);
+            publish_inflated(slot);
+        }
+    } catch (...) {
+        fail(std::current_exception());
+    }
+}
+
+void GzipReader::publish_inflated(Slot& slot) {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        slot.state = SlotState::Ready;
+    }
+    cv.notify_all();
+}
+
+void GzipReader::inflate_bgzf_slot(Slot& slot) {
+    z_stream strm{};
+    if (inflateInit2(&strm, -15) != Z_OK) {
+        throw std::runtime_error("Could not initialize zlib");
+    }
+    slot.data.resize(slot.blocks.back().second);
+    for (size_t b = 0; b + 1 < slot.blocks.size(); ++b) {
+        auto [block_start, data_start] = slot.blocks[b];
+        size_t block_end = slot.blocks[b + 1].first;
+        size_t data_end = slot.blocks[b + 1].second;
+        const unsigned char* block = slot.compressed.data() + block_start;
+        size_t xlen = read_le16(block + 10);
+        const unsigned char* footer = slot.compressed.data() + block_end - 8;
+
+        inflateReset(&strm);
+        strm.next_in = const_cast<unsigned char*>(block + 12 + xlen);
+        strm.avail_in = footer - strm.next_in;
+        strm.next_out = reinterpret_cast<unsigned char*>(slot.data.data() + data_start);
+        strm.avail_out = data_end - data_start;
+        int ret = inflate(&strm, Z_FINISH);
+        bool ok = ret == Z_STREAM_END && strm.avail_out == 0
+            && crc32(0, reinterpret_cast<unsigned char*>(slot.data.data() + data_start), data_end - data_start) == read_le32(footer);
+        if (!ok) {
+            inflateEnd(&strm);
+            throw InvalidFile("Corrupt BGZF block in " + filename);
+        }
+    }
+    inflateEnd(&strm);
+}
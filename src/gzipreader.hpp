@@ -0,0 +1,89 @@
+#ifndef GZIPREADER_HPP
+#define GZIPREADER_HPP
+
+#include <condition_variable>
+#include <cstdio>
+#include <exception>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+ * Reads a file that is gzip-compressed, BGZF-compressed or uncompressed and
+ * returns its decompressed contents. Decompression happens on background
+ * threads ahead of the caller:
+ *
+ * - BGZF files consist of independent gzip blocks of at most 64 KiB. One
+ *   thread reads groups of blocks, and n_threads threads inflate the groups
+ *   in parallel.
+ * - Plain gzip files can only be inflated sequentially. This is done on a
+ *   single thread so that inflating overlaps with parsing the output.
+ * - Uncompressed files are read on a single thread.
+ *
+ * Decompressed data is passed on in a fixed number of slots that are used
+ * round-robin, so the threads run at most that many slots ahead.
+ */
+class GzipReader {
+public:
+    GzipReader(const std::string& filename, size_t n_threads = 1);
+    // Read from an open file, such as a socket, which is closed in the
+    // destructor. The name is only used in error messages.
+    GzipReader(std::FILE* file, const std::string& name, size_t n_threads = 1);
+    ~GzipReader();
+    GzipReader(const GzipReader&) = delete;
+    GzipReader& operator=(const GzipReader&) = delete;
+
+    // Read up to length bytes. Return the number of bytes read, which is 0
+    // only at the end of the file. Throws InvalidFile if the input is corrupt.
+    size_t read(char* buffer, size_t length);
+
+    bool is_bgzf() const {
+        return bgzf;
+    }
+
+private:
+    enum class SlotState { Free, Compressed, Ready };
+    struct Slot {
+        SlotState state{SlotState::Free};
+        std::vector<unsigned char> compressed;
+        // Offset of each BGZF block in compressed and of its data in data
+        std::vector<std::pair<size_t, size_t>> blocks;
+        std::vector<char> data;
+    };
+
+    size_t read_input(unsigned char* buffer, size_t length);
+    void read_exactly(unsigned char* buffer, size_t length);
+    bool wait_for_free_slot(size_t seq);
+    void publish(size_t seq, SlotState state);
+    void publish_inflated(Slot& slot);
+    void finish();
+    void fail(std::exception_ptr e);
+
+    void read_uncompressed();
+    void inflate_gzip();
+    void read_bgzf_blocks();
+    void inflate_bgzf_blocks();
+    void inflate_bgzf_slot(Slot& slot);
+
+    std::string filename;
+    std::FILE* file;
+    bool bgzf{false};
+    // Bytes read from the file to detect its format that have not been used
+    std::vector<unsigned char> pending;
+    size_t pending_pos{0};
+
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::vector<Slot> slots;
+    size_t n_filled{0};    // slots filled by the producer (a sequence number)
+    size_t n_inflated{0};  // compressed slots claimed by inflating threads
+    size_t n_read{0};      // slots consumed by read()
+    size_t read_pos{0};    // position in the data of the current slot
+    bool finished{false};  // producer has reached the end of the file
+    bool stopping{false};
+    std::exception_ptr error;
+    std::vector<std::thread> threads;
+};
+
+#endif
@@ -6,7 +6,8 @@
 //
 #include "index.hpp"
 
-#include <math.h>   /* pow */
+#include <sstream>
+#include <cstring>
 #include <fstream>
 #include <cassert>
 #include <algorithm>
@@ -14,38 +15,105 @@
 #include <iostream>
 #include <thread>
 #include <atomic>
-#include <hyperloglog/hyperloglog.hpp>
+#include <queue>
 #include "io.hpp"
+#include "parallel.hpp"
+#include "tmpdir.hpp"
 #include "timer.hpp"
 #include "logger.hpp"
 
 static Logger& logger = Logger::get();
-static const uint32_t STI_FILE_FORMAT_VERSION = 1;
+static const uint32_t STI_FILE_FORMAT_VERSION = 4;
 
-bool cmp(const RefRandstrobeWithHash lhs, const RefRandstrobeWithHash rhs) { return (lhs.hash & StrobemerIndex::hash_mask) < (rhs.hash & StrobemerIndex::hash_mask); }
+static const unsigned int MIN_BITS = 16;
+static const unsigned int MAX_BITS = 31;
+
+/*
+ * Pick the number of bucket bits for an index with the given number of
+ * randstrobes such that there are about two randstrobes per bucket.
+ *
+ * At least MIN_BITS bits are used since the bits also store the count of
+ * each hash, and the bucket table is small then anyway (256 KiB).
+ */
+unsigned int StrobemerIndex::pick_bits(size_t size) {
+    size_t n_buckets = size / 2;
+    unsigned int b = MIN_BITS;
+    while (b < MAX_BITS && (size_t(1) << b) < n_buckets) {
+        b++;
+    }
+    return b;
+}
+
+static inline void prefetch(const void* address) {
+#ifdef __GNUC__
+    __builtin_prefetch(address);
+#endif
+}
 
 const int MAX_LINEAR_SEARCH = 4;
 unsigned int StrobemerIndex::find(uint64_t key) const{
-    const unsigned int top_N = key >> (64 - N);
-    int position_start = hash_positions[top_N];
-    int position_end = hash_positions[top_N + 1];
+    const unsigned int top_N = key >> (64 - bits);
+    return find_in_bucket(key, hash_positions[top_N], hash_positions[top_N + 1]);
+}
+
+/*
+ * Look up the hashes of all query randstrobes: positions[i] is set to
+ * find(query_randstrobes[i].hash).
+ *
+ * A lookup needs two dependent memory accesses (the bucket table, then the
+ * hash column), which are mostly cache misses for large indexes. Here, the
+ * bucket table entries for a batch of randstrobes are prefetched first, then
+ * the starts of their buckets in the hash column, and only then are the
+ * buckets searched, so that the memory latencies within a batch overlap.
+ */
+void StrobemerIndex::find_all(const QueryRandstrobeVector& query_randstrobes, std::vector<unsigned int>& positions) const {
+    const size_t batch_size = 32;
+    const size_t n = query_randstrobes.size();
+    positions.resize(n);
+    unsigned int bucket_starts[batch_size];
+    unsigned int bucket_ends[batch_size];
+    for (size_t first = 0; first < n; first += batch_size) {
+        const size_t last = std::min(first + batch_size, n);
+        for (size_t i = first; i < last; ++i) {
+            prefetch(hash_positions + (query_randstrobes[i].hash >> (64 - bits)));
+        }
+        for (size_t i = first; i < last; ++i) {
+            const unsigned int top_N = query_randstrobes[i].hash >> (64 - bits);
+            bucket_starts[i - first] = hash_positions[top_N];
+            bucket_ends[i - first] = hash_positions[top_N + 1];
+            prefetch(hashes + bucket_starts[i - first]);
+        }
+        for (size_t i = first; i < last; ++i) {
+            positions[i] = find_in_bucket(query_randstrobes[i].hash, bucket_starts[i - first], bucket_ends[i - first]);
+            if (positions[i] != static_cast<unsigned int>(-1)) {
+                prefetch(locations + positions[i]);
+            }
+        }
+    }
+}
 
+/* Search for key among the entries [position_start, position_end) of a bucket */
+unsigned int StrobemerIndex::find_in_bucket(uint64_t key, int position_start, int position_end) const {
     if(position_start == position_end){
         return -1;
     }
 
+    // Only the hash column is searched
+    const uint64_t masked_key = key & hash_mask;
     if (position_end - position_start < MAX_LINEAR_SEARCH) {
           for ( ; position_start < position_end; ++position_start) {
-              if ((randstrobes_vector[position_start].hash & hash_mask) == (key & hash_mask)) return position_start;
+              if ((hashes[position_start] & hash_mask) == masked_key) return position_start;
           }
           return -1;
       }
 
-    auto pos = std::lower_bound(randstrobes_vector.begin() + position_start,
-                                               randstrobes_vector.begin() + position_end,
-                                               RefRandstrobeWithHash{key & hash_mask, 0, 0},
-                                               cmp);
-    if ((pos->hash & hash_mask) == (key & hash_mask)) return pos - randstrobes_vector.begin();
+    auto pos = std::lower_bound(hashes + position_start,
+                                               hashes + position_end,
+                                               masked_key,
+                                               [this](uint64_t lhs, uint64_t rhs) {
+                                                   return (lhs & hash_mask) < rhs;
+                                               });
+    if (pos != hashes + position_end && (*pos & hash_mask) == masked_key) return pos - hashes;
     return -1;
 }
 
@@ -64,30 +132,112 @@ uint64_t count_unique_hashes(const std::vector<RefRandstrobeWithHash>& mers){
     return unique_elements;
 }
 
-void StrobemerIndex::write(const std::string& filename) const {
-    std::ofstream ofs(filename, std::ios::binary);
+/*
+ * Sections of the index file (hashes, locations and the bucket table) start
+ * at offsets that are multiples of this value. It is a multiple of the page
+ * size on all common platforms, which allows to memory-map the sections
+ * directly.
+ */
+static const uint64_t STI_SECTION_ALIGNMENT = 65536;
+
+static uint64_t align_offset(uint64_t offset) {
+    return (offset + STI_SECTION_ALIGNMENT - 1) / STI_SECTION_ALIGNMENT * STI_SECTION_ALIGNMENT;
+}
+
+static void pad_to(std::ostream& os, uint64_t offset) {
+    std::vector<char> padding(offset - os.tellp(), 0);
+    os.write(padding.data(), padding.size());
+}
 
-    ofs.write("STI\1", 4); // Magic number
-    write_int_to_ostream(ofs, STI_FILE_FORMAT_VERSION);
+/*
+ * Write the file header for an index with n_randstrobes entries and return
+ * where the sections start.
+ */
+StiSections StrobemerIndex::write_sti_header(std::ostream& os, uint64_t n_randstrobes) const {
+    os.write("STI\1", 4); // Magic number
+    write_int_to_ostream(os, STI_FILE_FORMAT_VERSION);
 
     // Variable-length chunk reserved for future use
     std::vector<char> reserved_chunk{0, 0, 0, 0, 0, 0, 0, 0};
-    write_vector(ofs, reserved_chunk);
+    write_vector(os, reserved_chunk);
 
-    write_int_to_ostream(ofs, filter_cutoff);
-    parameters.write(ofs);
+    write_int_to_ostream(os, filter_cutoff);
+    write_int_to_ostream(os, index_cutoff);
+    parameters.write(os);
+    write_int_to_ostream(os, bits);
 
-    write_vector(ofs, flat_vector);
+    uint64_t n_references = references.size();
+    uint64_t n_hash_positions = (uint64_t(1) << bits) + 1;
+    uint64_t header_end = uint64_t(os.tellp()) + 6 * sizeof(uint64_t);
+    StiSections sections;
+    sections.hashes_offset = align_offset(header_end);
+    sections.locations_offset = align_offset(sections.hashes_offset + n_randstrobes * sizeof(uint64_t));
+    sections.hash_positions_offset = align_offset(sections.locations_offset + n_randstrobes * sizeof(RefRandstrobeLocation));
+    uint64_t header[] = {
+        n_references, n_randstrobes, sections.hashes_offset, sections.locations_offset,
+        n_hash_positions, sections.hash_positions_offset
+    };
+    os.write(reinterpret_cast<const char*>(header), sizeof(header));
+    return sections;
+}
 
-    // write mers_index
-    auto size = uint64_t(randstrobe_map.size());
-    ofs.write(reinterpret_cast<char*>(&size), sizeof(size));
-    for (auto& p : randstrobe_map) {
-        ofs.write(reinterpret_cast<const char*>(&p.first), sizeof(p.first));
-        ofs.write(reinterpret_cast<const char*>(&p.second), sizeof(p.second));
+/*
+ * Write the index to a file. Layout:
+ * - header (magic number, version, parameters, section offsets and sizes)
+ * - padding
+ * - hashes section (n_randstrobes uint64_t entries)
+ * - padding
+ * - locations section (n_randstrobes RefRandstrobeLocation entries)
+ * - padding
+ * - hash_positions section ((1 << bits) + 1 entries)
+ */
+void StrobemerIndex::write(const std::string& filename) const {
+    std::ofstream ofs(filename, std::ios::binary);
+    if (!ofs.is_open()) {
+        throw InvalidIndexFile(filename + ": " + strerror(errno));
+    }
+
+    auto sections = write_sti_header(ofs, n_randstrobes);
+    uint64_t n_hash_positions = (uint64_t(1) << bits) + 1;
+    pad_to(ofs, sections.hashes_offset);
+    ofs.write(reinterpret_cast<const char*>(hashes), n_randstrobes * sizeof(uint64_t));
+    pad_to(ofs, sections.locations_offset);
+    ofs.write(reinterpret_cast<const char*>(locations), n_randstrobes * sizeof(RefRandstrobeLocation));
+    pad_to(ofs, sections.hash_positions_offset);
+    ofs.write(reinterpret_cast<const char*>(hash_positions), n_hash_positions * sizeof(unsigned int));
+    if (!ofs) {
+        throw InvalidIndexFile(filename + ": error writing index file");
     }
 }
 
+uint64_t StrobemerIndex::serialized_size() const {
+    std::ostringstream os;
+    auto sections = write_sti_header(os, n_randstrobes);
+    uint64_t n_hash_positions = (uint64_t(1) << bits) + 1;
+    return sections.hash_positions_offset + n_hash_positions * sizeof(unsigned int);
+}
+
+/*
+ * Write the index in the same layout as write(const std::string&) to data,
+ * which must have room for serialized_size() bytes.
+ */
+void StrobemerIndex::write(char* data) const {
+    std::ostringstream os;
+    auto sections = write_sti_header(os, n_randstrobes);
+    std::string header = os.str();
+    uint64_t n_hash_positions = (uint64_t(1) << bits) + 1;
+    std::memset(data, 0, sections.hashes_offset);
+    std::memcpy(data, header.data(), header.size());
+    std::memcpy(data + sections.hashes_offset, hashes, n_randstrobes * sizeof(uint64_t));
+    std::memcpy(data + sections.locations_offset, locations, n_randstrobes * sizeof(RefRandstrobeLocation));
+    std::memcpy(data + sections.hash_positions_offset, hash_positions, n_hash_positions * sizeof(unsigned int));
+}
+
+/*
+ * Load an index written by write(). The hashes, locations and hash_positions
+ * sections are not copied, but used directly from a read-only memory mapping
+ * of the file.
+ */
 void StrobemerIndex::read(const std::string& filename) {
     errno = 0;
     std::ifstream ifs(filename, std::ios::binary);
@@ -118,243 +268,726 @@ void StrobemerIndex::read(const std::string& filename) {
     ifs.seekg(reserved_chunk_size, std::ios_base::cur);
 
     filter_cutoff = read_int_from_istream(ifs);
+    index_cutoff = read_int_from_istream(ifs);
     const IndexParameters sti_parameters = IndexParameters::read(ifs);
     if (parameters != sti_parameters) {
         throw InvalidIndexFile("Index parameters in .sti file and those specified on command line differ");
     }
+    unsigned int sti_bits = read_int_from_istream(ifs);
+    if (sti_bits < MIN_BITS || sti_bits > MAX_BITS) {
+        throw InvalidIndexFile("Index file has an invalid number of bucket bits");
+    }
+
+    uint64_t header[6];
+    ifs.read(reinterpret_cast<char*>(header), sizeof(header));
+    if (!ifs) {
+        throw InvalidIndexFile("Index file is truncated");
+    }
+    auto [n_references, sti_n_randstrobes, hashes_offset, locations_offset, n_hash_positions, hash_positions_offset] = header;
+    if (n_references != references.size()) {
+        throw InvalidIndexFile("Index file was created for a reference with a different number of contigs");
+    }
+    if (n_hash_positions != (uint64_t(1) << sti_bits) + 1) {
+        throw InvalidIndexFile("Index file has an invalid bucket table size");
+    }
+    ifs.close();
+
+    try {
+        mapped_file = std::make_unique<MappedFile>(filename);
+    } catch (const InvalidFile& e) {
+        throw InvalidIndexFile(e.what());
+    }
+    if (hashes_offset % STI_SECTION_ALIGNMENT != 0
+        || locations_offset % STI_SECTION_ALIGNMENT != 0
+        || hash_positions_offset % STI_SECTION_ALIGNMENT != 0
+        || hashes_offset + sti_n_randstrobes * sizeof(uint64_t) > mapped_file->size()
+        || locations_offset + sti_n_randstrobes * sizeof(RefRandstrobeLocation) > mapped_file->size()
+        || hash_positions_offset + n_hash_positions * sizeof(unsigned int) > mapped_file->size()) {
+        throw InvalidIndexFile("Index file is truncated or has invalid section offsets");
+    }
+    // Release the memory of an index built with populate()
+    std::vector<uint64_t>().swap(hashes_vector);
+    std::vector<RefRandstrobeLocation>().swap(locations_vector);
+    std::vector<unsigned int>().swap(hash_positions_vector);
+    hashes = reinterpret_cast<const uint64_t*>(mapped_file->data() + hashes_offset);
+    locations = reinterpret_cast<const RefRandstrobeLocation*>(mapped_file->data() + locations_offset);
+    n_randstrobes = sti_n_randstrobes;
+    set_bits(sti_bits);
+    hash_positions = reinterpret_cast<const unsigned int*>(mapped_file->data() + hash_positions_offset);
+}
 
-    read_vector(ifs, flat_vector);
-
-    uint64_t sz;
-    // read mers_index:
-    randstrobe_map.clear();
-    ifs.read(reinterpret_cast<char*>(&sz), sizeof(sz));
-    randstrobe_map.reserve(sz);
-    // read in big chunks
-    const uint64_t chunk_size = pow(2,20);//4 M => chunks of ~10 MB - The chunk size seem not to be that important
-    auto buf_size = std::min(sz, chunk_size) * (sizeof(RandstrobeMap::key_type) + sizeof(RandstrobeMap::mapped_type));
-    std::unique_ptr<char> buf_ptr(new char[buf_size]);
-    char* buf2 = buf_ptr.get();
-    auto left_to_read = sz;
-    while (left_to_read > 0) {
-        auto to_read = std::min(left_to_read, chunk_size);
-        ifs.read(buf2, to_read * (sizeof(RandstrobeMap::key_type) + sizeof(RandstrobeMap::mapped_type)));
-        //Add the elements directly from the buffer
-        for (size_t i = 0; i < to_read; ++i) {
-            auto start = buf2 + i * (sizeof(RandstrobeMap::key_type) + sizeof(RandstrobeMap::mapped_type));
-            randstrobe_map[*reinterpret_cast<RandstrobeMap::key_type*>(start)] = *reinterpret_cast<RandstrobeMap::mapped_type*>(start + sizeof(RandstrobeMap::key_type));
-        }
-        left_to_read -= to_read;
+namespace {
+
+/*
+ * A stretch of a reference sequence for which randstrobes are generated
+ * independently. Only randstrobes whose first strobe starts within
+ * [start, end) are generated, but the second strobe may lie beyond end.
+ */
+struct RefSegment {
+    size_t ref_index;
+    size_t start;
+    size_t end;
+};
+
+/*
+ * Split the references into segments that can be processed in parallel.
+ * Contigs longer than max_segment_length are split at positions where a
+ * freshly started syncmer iterator is in the same state as one that has
+ * processed the contig from the beginning, so the generated randstrobes are
+ * identical to those of a serial run.
+ */
+std::vector<RefSegment> make_ref_segments(const References& references, const IndexParameters& parameters, size_t max_segment_length) {
+    std::vector<RefSegment> segments;
+    for (size_t ref_index = 0; ref_index < references.size(); ++ref_index) {
+        const auto& seq = references.sequences[ref_index];
+        if (seq.length() < parameters.w_max) {
+            continue;
+        }
+        size_t start = 0;
+        while (start < seq.length()) {
+            size_t end = seq.length();
+            if (seq.length() - start > max_segment_length) {
+                end = find_syncmer_resync_position(seq, start + max_segment_length, parameters.k, parameters.s);
+            }
+            segments.push_back(RefSegment{ref_index, start, end});
+            start = end;
+        }
     }
+    return segments;
 }
 
-int estimate_randstrobe_hashes(const std::string& seq, const IndexParameters& parameters) {
-    int num = 0;
+/*
+ * Open syncmers are sampled at a density of about 1/(k - s + 1), which gives
+ * the expected number of randstrobes in a stretch of sequence.
+ */
+size_t expected_randstrobe_count(size_t length, const IndexParameters& parameters) {
+    return length / (parameters.k - parameters.s + 1);
+}
 
-    auto randstrobe_iter = RandstrobeIterator2(seq, parameters.k, parameters.s, parameters.t_syncmer, parameters.w_min, parameters.w_max, parameters.max_dist);
+void add_randstrobes_of_segment(
+    const std::string& seq,
+    const RefSegment& segment,
+    const IndexParameters& parameters,
+    std::vector<RefRandstrobeWithHash>& randstrobes
+) {
+    // Reserving for the expected count avoids most reallocations without a
+    // separate counting pass
+    randstrobes.reserve(expected_randstrobe_count(segment.end - segment.start, parameters));
+    auto randstrobe_iter = RandstrobeIterator2(seq, parameters.k, parameters.s, parameters.t_syncmer, parameters.w_min, parameters.w_max, parameters.max_dist, segment.start);
     Randstrobe randstrobe;
     while ((randstrobe = randstrobe_iter.next()) != randstrobe_iter.end()) {
-        num++;
+        if (randstrobe.strobe1_pos >= segment.end) {
+            break;
+        }
+        RefRandstrobeWithHash::packed_t packed = segment.ref_index << 8;
+        packed = packed + (randstrobe.strobe2_pos - randstrobe.strobe1_pos);
+        randstrobes.push_back(RefRandstrobeWithHash{randstrobe.hash, randstrobe.strobe1_pos, packed});
     }
-    return num;
 }
 
-size_t estimate_randstrobe_hashes_parallel(const References& references, const IndexParameters& parameters, size_t n_threads) {
-    std::vector<std::thread> workers;
-    int total = 0;
-    std::atomic_size_t ref_index = 0;
+/*
+ * Generate the randstrobes of segments [first, last) in parallel. The
+ * randstrobes of each segment are returned in a separate buffer;
+ * concatenating the buffers gives the same sequence of randstrobes as
+ * generating them serially.
+ */
+std::vector<std::vector<RefRandstrobeWithHash>> generate_randstrobes(
+    const References& references,
+    const IndexParameters& parameters,
+    const std::vector<RefSegment>& segments,
+    size_t first,
+    size_t last,
+    size_t n_threads
+) {
+    std::vector<std::vector<RefRandstrobeWithHash>> segment_randstrobes(last - first);
+    run_in_parallel(last - first, n_threads, [&](size_t j) {
+        const auto& segment = segments[first + j];
+        add_randstrobes_of_segment(references.sequences[segment.ref_index], segment, parameters, segment_randstrobes[j]);
+    });
+    return segment_randstrobes;
+}
+
+/*
+ * Move the randstrobes from the per-segment buffers into out, grouped into
+ * 2^P partitions by the top P bits of their hash. The partitions can
+ * afterwards be sorted independently, and out is sorted once all of them are.
+ *
+ * The scatter is stable: Within a partition, randstrobes appear in the same
+ * order as in the concatenation of the segment buffers. The segment buffers
+ * are freed as soon as they have been moved.
+ *
+ * Returns the start offsets of the partitions within out (with an
+ * additional entry for the end).
+ */
+std::vector<size_t> scatter_into_partitions(
+    std::vector<std::vector<RefRandstrobeWithHash>>& segment_randstrobes,
+    unsigned int P,
+    size_t n_threads,
+    std::vector<RefRandstrobeWithHash>& out
+) {
+    const size_t n_partitions = size_t(1) << P;
+    size_t total = 0;
+    for (auto& randstrobes : segment_randstrobes) {
+        total += randstrobes.size();
+    }
 
-    std::vector<int> estimators;
-    for (size_t i = 0; i < n_threads; ++i) {
-        estimators.push_back(0);
+    // Group consecutive segments into blocks of similar size. Each block is
+    // scattered by one thread.
+    const size_t n_blocks = std::min(4 * n_threads, segment_randstrobes.size());
+    std::vector<size_t> block_starts{0};
+    size_t block_size = 0;
+    for (size_t j = 0; j < segment_randstrobes.size(); ++j) {
+        block_size += segment_randstrobes[j].size();
+        if (block_size * n_blocks >= total && block_starts.size() < n_blocks && j + 1 < segment_randstrobes.size()) {
+            block_starts.push_back(j + 1);
+            block_size = 0;
+        }
     }
+    block_starts.push_back(segment_randstrobes.size());
+    const size_t n_actual_blocks = block_starts.size() - 1;
 
-    for (size_t i = 0; i < n_threads; ++i) {
-        workers.push_back(
-            std::thread(
-                [&ref_index](const References& references, const IndexParameters& parameters, int& estimator) {
-                    while (true) {
-                        size_t j = ref_index.fetch_add(1);
-                        if (j >= references.size()) {
-                            break;
-                        }
-                        estimator += estimate_randstrobe_hashes(references.sequences[j], parameters);
-                    }
-                }, std::ref(references), std::ref(parameters), std::ref(estimators[i]))
-        );
+    // Count randstrobes per partition and block, so that blocks can be
+    // scattered independently
+    std::vector<std::vector<size_t>> block_counts(n_actual_blocks, std::vector<size_t>(n_partitions, 0));
+    run_in_parallel(n_actual_blocks, n_threads, [&](size_t b) {
+        for (size_t j = block_starts[b]; j < block_starts[b + 1]; ++j) {
+            for (auto& randstrobe : segment_randstrobes[j]) {
+                block_counts[b][randstrobe.hash >> (64 - P)]++;
+            }
+        }
+    });
+
+    // Prefix sums
+    std::vector<size_t> partition_starts(n_partitions + 1);
+    std::vector<std::vector<size_t>> block_offsets(n_actual_blocks, std::vector<size_t>(n_partitions));
+    size_t offset = 0;
+    for (size_t p = 0; p < n_partitions; ++p) {
+        partition_starts[p] = offset;
+        for (size_t b = 0; b < n_actual_blocks; ++b) {
+            block_offsets[b][p] = offset;
+            offset += block_counts[b][p];
+        }
     }
-    for (auto& worker : workers) {
-        worker.join();
+    partition_starts[n_partitions] = offset;
+    assert(offset == total);
+
+    // Scatter
+    out.clear();
+    out.resize(total);
+    run_in_parallel(n_actual_blocks, n_threads, [&](size_t b) {
+        auto& offsets = block_offsets[b];
+        for (size_t j = block_starts[b]; j < block_starts[b + 1]; ++j) {
+            for (auto& randstrobe : segment_randstrobes[j]) {
+                auto partition = randstrobe.hash >> (64 - P);
+                out[offsets[partition]++] = randstrobe;
+            }
+            std::vector<RefRandstrobeWithHash>().swap(segment_randstrobes[j]);
+        }
+    });
+
+    return partition_starts;
+}
+
+void sort_partitions(std::vector<RefRandstrobeWithHash>& randstrobes, const std::vector<size_t>& partition_starts, size_t n_threads) {
+    run_in_parallel(partition_starts.size() - 1, n_threads, [&](size_t p) {
+        pdqsort_branchless(randstrobes.begin() + partition_starts[p], randstrobes.begin() + partition_starts[p + 1]);
+    });
+}
+
+/* Statistics on the number of occurrences of each distinct hash */
+struct HashCountStatistics {
+    unsigned int distinct = 0;
+    unsigned int occur_once = 0;
+    unsigned int high_ab = 0;
+    unsigned int mid_ab = 0;
+    std::vector<unsigned int> strobemer_counts;
+
+    void add(unsigned int count) {
+        distinct++;
+        if (count == 1) {
+            occur_once++;
+        } else if (count > 100) {
+            high_ab++;
+            strobemer_counts.push_back(count);
+        } else {
+            mid_ab++;
+            strobemer_counts.push_back(count);
+        }
     }
 
-    for (auto& estimator : estimators) {
-        total += estimator;
+    HashCountStatistics& operator+=(const HashCountStatistics& other) {
+        distinct += other.distinct;
+        occur_once += other.occur_once;
+        high_ab += other.high_ab;
+        mid_ab += other.mid_ab;
+        strobemer_counts.insert(strobemer_counts.end(), other.strobemer_counts.begin(), other.strobemer_counts.end());
+        return *this;
     }
-    return total;
+};
+
+void fill_statistics(IndexCreationStatistics& stats, HashCountStatistics& counts, int filter_cutoff) {
+    stats.tot_occur_once = counts.occur_once;
+    stats.frac_unique = counts.distinct > 0 ? 1.0 * counts.occur_once / counts.distinct : 0;
+    stats.tot_high_ab = counts.high_ab;
+    stats.tot_mid_ab = counts.mid_ab;
+    stats.tot_distinct_strobemer_count = counts.distinct;
+
+    std::sort(counts.strobemer_counts.begin(), counts.strobemer_counts.end(), std::greater<int>());
+
+    stats.index_cutoff = filter_cutoff;
+    stats.filter_cutoff = filter_cutoff;
+    stats.unique_mers = counts.distinct;
 }
 
-void StrobemerIndex::populate(int filter_cutoff, size_t n_threads) {
-    stats.tot_strobemer_count = 0;
+/*
+ * Derive the filter cutoff from the distribution of hash counts: About
+ * filter_fraction of the distinct hashes have a count above the returned
+ * cutoff. counts.strobemer_counts must be sorted in descending order.
+ */
+unsigned int filter_cutoff_from_fraction(const HashCountStatistics& counts, float filter_fraction, IndexCreationStatistics& stats) {
+    size_t index_cutoff = counts.distinct * filter_fraction;
+    unsigned int filter_cutoff;
+    if (counts.strobemer_counts.empty()) {
+        // All hashes are unique
+        filter_cutoff = 1;
+    } else if (index_cutoff < counts.strobemer_counts.size()) {
+        filter_cutoff = counts.strobemer_counts[index_cutoff];
+    } else {
+        filter_cutoff = counts.strobemer_counts.back();
+    }
+    stats.index_cutoff = index_cutoff;
+    stats.filter_cutoff = filter_cutoff;
+    return filter_cutoff;
+}
+
+/* Sequential reader for a file of sorted randstrobes written during an external build */
+class RunReader {
+public:
+    RunReader(const std::string& filename, size_t size, size_t buffer_size)
+        : ifs(filename, std::ios::binary), remaining(size), buffer(buffer_size) {
+        if (!ifs.is_open()) {
+            throw InvalidIndexFile(filename + ": " + strerror(errno));
+        }
+        fill();
+    }
+
+    bool empty() const {
+        return i == buffer_end;
+    }
+
+    const RefRandstrobeWithHash& front() const {
+        return buffer[i];
+    }
+
+    void pop() {
+        ++i;
+        if (i == buffer_end) {
+            fill();
+        }
+    }
+
+private:
+    void fill() {
+        buffer_end = std::min(remaining, buffer.size());
+        ifs.read(reinterpret_cast<char*>(buffer.data()), buffer_end * sizeof(RefRandstrobeWithHash));
+        if (!ifs) {
+            throw InvalidIndexFile("Error reading temporary index file");
+        }
+        remaining -= buffer_end;
+        i = 0;
+    }
+
+    std::ifstream ifs;
+    size_t remaining;
+    std::vector<RefRandstrobeWithHash> buffer;
+    size_t buffer_end = 0;
+    size_t i = 0;
+};
+
+/* Buffered writer for an array of fixed-size items */
+template <typename T>
+class ArrayWriter {
+public:
+    ArrayWriter(std::ostream& os, size_t buffer_size) : os(os) {
+        buffer.reserve(buffer_size);
+    }
+
+    ~ArrayWriter() {
+        flush();
+    }
+
+    void push_back(const T& item) {
+        buffer.push_back(item);
+        if (buffer.size() == buffer.capacity()) {
+            flush();
+        }
+    }
+
+    void flush() {
+        os.write(reinterpret_cast<const char*>(buffer.data()), buffer.size() * sizeof(T));
+        buffer.clear();
+    }
 
-    Timer estimate_unique;
-    auto randstrobe_hashes = estimate_randstrobe_hashes_parallel(references, parameters, n_threads);
-    stats.elapsed_unique_hashes = estimate_unique.duration();
-    logger.debug() << "Estimated number of randstrobe hashes: " << randstrobe_hashes << '\n';
-    // randstrobe_map.reserve(randstrobe_hashes);
+private:
+    std::ostream& os;
+    std::vector<T> buffer;
+};
+
+/*
+ * Merge sorted runs of randstrobes stored in files and call
+ * process_equal_hashes for each group of randstrobes with the same hash, in
+ * order of increasing hash. Within a group, randstrobes from earlier runs
+ * come first.
+ */
+template <typename F>
+void merge_runs(const std::vector<std::string>& run_paths, const std::vector<size_t>& run_sizes, size_t buffer_size, F process_equal_hashes) {
+    std::vector<RunReader> readers;
+    readers.reserve(run_paths.size());
+    for (size_t r = 0; r < run_paths.size(); ++r) {
+        readers.emplace_back(run_paths[r], run_sizes[r], buffer_size);
+    }
+    using HeapEntry = std::pair<randstrobe_hash_t, size_t>;
+    std::priority_queue<HeapEntry, std::vector<HeapEntry>, std::greater<HeapEntry>> heap;
+    for (size_t r = 0; r < readers.size(); ++r) {
+        if (!readers[r].empty()) {
+            heap.emplace(readers[r].front().hash, r);
+        }
+    }
+    std::vector<RefRandstrobeWithHash> equal_hashes;
+    while (!heap.empty()) {
+        auto [hash, r] = heap.top();
+        heap.pop();
+        if (!equal_hashes.empty() && equal_hashes[0].hash != hash) {
+            process_equal_hashes(equal_hashes);
+            equal_hashes.clear();
+        }
+        equal_hashes.push_back(readers[r].front());
+        readers[r].pop();
+        if (!readers[r].empty()) {
+            heap.emplace(readers[r].front().hash, r);
+        }
+    }
+    if (!equal_hashes.empty()) {
+        process_equal_hashes(equal_hashes);
+    }
+}
+
+} // namespace
+
+/*
+ * Generate the index from the references.
+ *
+ * If build_memory is nonzero and building the index in memory would need
+ * more than that many bytes, it is built with populate_external() instead.
+ *
+ * If filter_fraction is nonzero, the filter cutoff is not taken from the
+ * parameters, but chosen such that about that fraction of the distinct
+ * hashes is filtered.
+ */
+void StrobemerIndex::populate(int filter_cutoff, size_t n_threads, size_t build_memory, bool drop_repetitive, float filter_fraction) {
+    index_cutoff = 0;
+    stats.dropped_randstrobes = 0;
+    const size_t expected_size = expected_randstrobe_count(references.total_length(), parameters);
+    // Segment buffers and the sorted vector (or the sorted vector and the
+    // index columns) exist at the same time
+    if (build_memory > 0 && 2 * expected_size * sizeof(RefRandstrobeWithHash) > build_memory) {
+        logger.info() << "Index is not expected to fit into the build memory limit, building it in external memory\n";
+        populate_external(filter_cutoff, n_threads, build_memory, drop_repetitive, filter_fraction);
+        return;
+    }
 
     Timer randstrobes_timer;
-    add_randstrobes_to_vector(randstrobe_hashes);
+    const size_t min_segment_length = 1'000'000;
+    auto max_segment_length = std::max(references.total_length() / (4 * n_threads), min_segment_length);
+    auto segments = make_ref_segments(references, parameters, max_segment_length);
+    auto segment_randstrobes = generate_randstrobes(references, parameters, segments, 0, segments.size(), n_threads);
+    stats.tot_strobemer_count = 0;
+    for (auto& randstrobes : segment_randstrobes) {
+        stats.tot_strobemer_count += randstrobes.size();
+    }
     stats.elapsed_generating_seeds = randstrobes_timer.duration();
 
+    set_bits(pick_bits(stats.tot_strobemer_count));
+    logger.debug() << "Using " << bits << " bits for the bucket table\n";
+
+    // Partition p contains the randstrobes of buckets
+    // [p << (bits - P), (p + 1) << (bits - P)), so each partition can be
+    // sorted and count-encoded independently.
     Timer sorting_timer;
-    // sort by hash valuesles
-    pdqsort_branchless(randstrobes_vector.begin(), randstrobes_vector.end());
+    const unsigned int P = std::min(bits, 12u);
+    std::vector<RefRandstrobeWithHash> randstrobes_vector;
+    auto partition_starts = scatter_into_partitions(segment_randstrobes, P, n_threads, randstrobes_vector);
+    sort_partitions(randstrobes_vector, partition_starts, n_threads);
     stats.elapsed_sorting_seeds = sorting_timer.duration();
 
     Timer hash_index_timer;
-    // stats.flat_vector_size = randstrobes_vector.size();
-
-    unsigned int offset = 0;
-    unsigned int tot_high_ab = 0;
-    unsigned int tot_mid_ab = 0;
-    std::vector<unsigned int> strobemer_counts;
-
-    unsigned int randstrobe_hash_size = 0;      
-    uint64_t prev_hash = -1;
-    
-    // stats.flat_vector_size = 0;
-    stats.tot_occur_once = 0;
-    // calculate stats.flat_vector_size, randstrobe_hash_size
-    // add the top N bits of hash to the hash_positions
-    // calculate the count of hash that exists more than one time
-    unsigned int count = 0;
-    unsigned int position = 0;
-    unsigned int prev_hash_N = 0;
-    bool occur_once = false;
-    for (auto &mer: randstrobes_vector){
-        uint64_t hash_value = mer.hash;
-        if (position == 0){
-            randstrobe_hash_size += 1;
-            occur_once = true;
-            unsigned int existing_hash_N = hash_value >> (64 - N);
-            hash_positions[existing_hash_N] = position;
-            for (unsigned int index_temp = 0; index_temp < existing_hash_N; index_temp++){
-                hash_positions[index_temp] = position;
+    const size_t n_partitions = partition_starts.size() - 1;
+    const size_t buckets_per_partition = size_t(1) << (bits - P);
+    const uint64_t max_count = ((uint64_t)1 << bits) - 1;
+    hash_positions_vector.assign((size_t(1) << bits) + 1, 0);
+    hash_positions_vector.shrink_to_fit();
+    std::vector<HashCountStatistics> partition_stats(n_partitions);
+    auto for_each_run = [&](size_t p, auto f) {
+        auto begin = randstrobes_vector.begin() + partition_starts[p];
+        auto end = randstrobes_vector.begin() + partition_starts[p + 1];
+        for (auto it = begin; it != end; ) {
+            auto run_end = it + 1;
+            while (run_end != end && run_end->hash == it->hash) {
+                ++run_end;
             }
-            prev_hash_N = existing_hash_N;
-            position += 1;
-            count += 1;
-            prev_hash = hash_value;
-            continue;
+            f(it, run_end);
+            it = run_end;
         }
-
-        if (hash_value == prev_hash){
-            occur_once = false;
-            position += 1;
-            count += 1;
-            continue;
+    };
+    auto finish_statistics = [&]() {
+        HashCountStatistics counts;
+        for (auto& pstats : partition_stats) {
+            counts += pstats;
+        }
+        fill_statistics(stats, counts, filter_cutoff);
+        if (filter_fraction > 0) {
+            this->filter_cutoff = filter_cutoff_from_fraction(counts, filter_fraction, stats);
         }
+    };
 
-        if (hash_value != prev_hash){
-            randstrobe_hash_size += 1;
-            if (occur_once == true){
-                stats.tot_occur_once += 1;
-            }else{
-                occur_once = true;
-            }
+    // Dropping runs needs the final filter cutoff, so if it is derived from
+    // the count distribution, the counts are collected in a separate pass
+    const bool count_separately = drop_repetitive && filter_fraction > 0;
+    if (count_separately) {
+        run_in_parallel(n_partitions, n_threads, [&](size_t p) {
+            for_each_run(p, [&](auto it, auto run_end) {
+                partition_stats[p].add(run_end - it);
+            });
+        });
+        finish_statistics();
+    }
+    if (drop_repetitive) {
+        index_cutoff = this->filter_cutoff;
+    }
 
-            randstrobes_vector[position - count].hash = (prev_hash & hash_mask) | ((uint64_t)count << (64 - N));
-            if (count > 100){
-                tot_high_ab++;
-                strobemer_counts.push_back(count);
-            }else if (count > 1){
-                tot_mid_ab++;
-                strobemer_counts.push_back(count);
+    std::vector<size_t> partition_sizes(n_partitions);
+    run_in_parallel(n_partitions, n_threads, [&](size_t p) {
+        // Count-encode the runs of the partition and compact it in place if
+        // repetitive runs are dropped. hash_positions is filled with offsets
+        // relative to the start of the partition for now.
+        const size_t first_bucket = p * buckets_per_partition;
+        size_t next_bucket = first_bucket;
+        auto begin = randstrobes_vector.begin() + partition_starts[p];
+        auto out = begin;
+        for_each_run(p, [&](auto it, auto run_end) {
+            unsigned int count = run_end - it;
+            if (!count_separately) {
+                partition_stats[p].add(count);
             }
-            count = 1;
-            unsigned int existing_hash_N = hash_value >> (64 - N);
-            if (existing_hash_N != prev_hash_N){
-                hash_positions[existing_hash_N] = position;
-                for (unsigned int index_temp = prev_hash_N + 1; index_temp < existing_hash_N; index_temp++){
-                    hash_positions[index_temp] = position;
+            for (size_t bucket = it->hash >> (64 - bits); next_bucket <= bucket; ++next_bucket) {
+                hash_positions_vector[next_bucket] = out - begin;
             }
-            prev_hash_N = existing_hash_N;
+            // The first entry of each run stores the run length in the top
+            // bits. Runs too long to be represented are saturated; they are
+            // far above any useful filter cutoff anyway.
+            uint64_t stored_count = std::min(uint64_t(count), max_count);
+            it->hash = (it->hash & hash_mask) | (stored_count << (64 - bits));
+            if (is_dropped_count(stored_count)) {
+                *out++ = *it;
+            } else {
+                out = std::move(it, run_end, out);
             }
+        });
+        for ( ; next_bucket < first_bucket + buckets_per_partition; ++next_bucket) {
+            hash_positions_vector[next_bucket] = out - begin;
+        }
+        partition_sizes[p] = out - begin;
+    });
+    if (!count_separately) {
+        finish_statistics();
+    }
 
-            position += 1;
-            prev_hash = hash_value;
+    // Split the partitions into the hash and location columns, closing the
+    // gaps left by dropped runs, and make hash_positions absolute
+    std::vector<size_t> compacted_starts(n_partitions + 1, 0);
+    for (size_t p = 0; p < n_partitions; ++p) {
+        compacted_starts[p + 1] = compacted_starts[p] + partition_sizes[p];
+    }
+    const size_t n_stored = compacted_starts[n_partitions];
+    hashes_vector.resize(n_stored);
+    hashes_vector.shrink_to_fit();
+    locations_vector.resize(n_stored);
+    locations_vector.shrink_to_fit();
+    run_in_parallel(n_partitions, n_threads, [&](size_t p) {
+        for (size_t i = 0; i < partition_sizes[p]; ++i) {
+            auto& randstrobe = randstrobes_vector[partition_starts[p] + i];
+            hashes_vector[compacted_starts[p] + i] = randstrobe.hash;
+            locations_vector[compacted_starts[p] + i] = RefRandstrobeLocation{randstrobe.position, randstrobe.packed};
+        }
+        for (size_t bucket = p * buckets_per_partition; bucket < (p + 1) * buckets_per_partition; ++bucket) {
+            hash_positions_vector[bucket] += compacted_starts[p];
         }
+    });
+    std::vector<RefRandstrobeWithHash>().swap(randstrobes_vector);
+    hash_positions_vector[size_t(1) << bits] = n_stored;
+    stats.dropped_randstrobes = stats.tot_strobemer_count - n_stored;
+    stats.elapsed_hash_index = hash_index_timer.duration();
 
-        if (&mer == &randstrobes_vector.back()){
-            if (occur_once == true){
-                stats.tot_occur_once += 1;
-            }
-            if (count > 100){
-                tot_high_ab++;
-                strobemer_counts.push_back(count);
-            }else if (count > 1){
-                tot_mid_ab++;
-                strobemer_counts.push_back(count);
-            }
-            randstrobes_vector[position - (count - 1)].hash = (prev_hash & hash_mask) | ((uint64_t)count << (64 - N));
-            for (unsigned int index_temp = prev_hash_N + 1; index_temp < (1 << N); index_temp++){
-                    hash_positions[index_temp] = randstrobes_vector.size();
-            }
+    mapped_file.reset();
+    hashes = hashes_vector.data();
+    locations = locations_vector.data();
+    n_randstrobes = n_stored;
+    hash_positions = hash_positions_vector.data();
+}
+
+/*
+ * Build the index using about build_memory bytes of memory.
+ *
+ * The segments are processed in batches that fit into the memory limit.
+ * The randstrobes of each batch are sorted and written to a temporary file
+ * (a "run"). The runs are then merged into an index file, which is finally
+ * memory-mapped with read(). The hash_positions table is streamed to a
+ * temporary file during the merge, so that the memory needed does not depend
+ * on the size of the reference.
+ */
+void StrobemerIndex::populate_external(int filter_cutoff, size_t n_threads, size_t build_memory, bool drop_repetitive, float filter_fraction) {
+    TemporaryDirectory tmp_dir("namfinder");
+
+    // A batch needs its segment buffers and a sorted copy of them
+    const size_t batch_capacity = std::max(build_memory / (2 * sizeof(RefRandstrobeWithHash)), size_t(1));
+    const size_t min_segment_length = 100'000;
+    auto max_segment_length = std::max(batch_capacity * (parameters.k - parameters.s + 1) / n_threads, min_segment_length);
+    auto segments = make_ref_segments(references, parameters, max_segment_length);
+
+    std::vector<std::string> run_paths;
+    std::vector<size_t> run_sizes;
+    std::vector<RefRandstrobeWithHash> run;
+    stats.tot_strobemer_count = 0;
+    stats.elapsed_generating_seeds = std::chrono::duration<double>(0);
+    stats.elapsed_sorting_seeds = std::chrono::duration<double>(0);
+    for (size_t first = 0; first < segments.size(); ) {
+        size_t last = first;
+        size_t expected = 0;
+        while (last < segments.size() && (last == first || expected + expected_randstrobe_count(segments[last].end - segments[last].start, parameters) <= batch_capacity)) {
+            expected += expected_randstrobe_count(segments[last].end - segments[last].start, parameters);
+            last++;
+        }
+
+        Timer randstrobes_timer;
+        auto segment_randstrobes = generate_randstrobes(references, parameters, segments, first, last, n_threads);
+        stats.elapsed_generating_seeds += randstrobes_timer.duration();
+
+        Timer sorting_timer;
+        auto partition_starts = scatter_into_partitions(segment_randstrobes, 12, n_threads, run);
+        sort_partitions(run, partition_starts, n_threads);
+
+        std::string run_path = tmp_dir.path() / ("run-" + std::to_string(run_paths.size()));
+        std::ofstream ofs(run_path, std::ios::binary);
+        ofs.write(reinterpret_cast<const char*>(run.data()), run.size() * sizeof(RefRandstrobeWithHash));
+        if (!ofs) {
+            throw InvalidIndexFile(run_path + ": error writing temporary file");
         }
+        run_paths.push_back(run_path);
+        run_sizes.push_back(run.size());
+        stats.tot_strobemer_count += run.size();
+        stats.elapsed_sorting_seeds += sorting_timer.duration();
+        first = last;
     }
+    std::vector<RefRandstrobeWithHash>().swap(run);
+    logger.debug() << "Wrote " << run_paths.size() << " sorted runs of randstrobes to temporary files\n";
 
-    stats.frac_unique = 1.0 * stats.tot_occur_once / randstrobe_hash_size;
-    stats.tot_high_ab = tot_high_ab;
-    stats.tot_mid_ab = tot_mid_ab;
-    stats.tot_distinct_strobemer_count = randstrobe_hash_size;
+    set_bits(pick_bits(stats.tot_strobemer_count));
+    logger.debug() << "Using " << bits << " bits for the bucket table\n";
 
-    std::sort(strobemer_counts.begin(), strobemer_counts.end(), std::greater<int>());
+    // Merge the runs
+    Timer hash_index_timer;
+    const size_t reader_buffer_size = std::clamp(build_memory / (4 * sizeof(RefRandstrobeWithHash) * std::max(run_paths.size(), size_t(1))), size_t(1024), size_t(1) << 20);
+    // Dropping runs needs the final filter cutoff, so if it is derived from
+    // the count distribution, the counts are collected in a separate pass
+    HashCountStatistics counts;
+    const bool count_separately = drop_repetitive && filter_fraction > 0;
+    if (count_separately) {
+        merge_runs(run_paths, run_sizes, reader_buffer_size, [&](const std::vector<RefRandstrobeWithHash>& equal_hashes) {
+            counts.add(equal_hashes.size());
+        });
+        fill_statistics(stats, counts, filter_cutoff);
+        this->filter_cutoff = filter_cutoff_from_fraction(counts, filter_fraction, stats);
+    }
+    if (drop_repetitive) {
+        index_cutoff = this->filter_cutoff;
+    }
 
-    stats.index_cutoff = filter_cutoff;
-    stats.filter_cutoff = filter_cutoff;
-    stats.elapsed_hash_index = hash_index_timer.duration();
-    stats.unique_mers = randstrobe_hash_size;
-}
+    std::string sti_path = tmp_dir.path() / "index.sti";
+    std::string locations_path = tmp_dir.path() / "locations";
+    std::string buckets_path = tmp_dir.path() / "buckets";
+    std::ofstream ofs(sti_path, std::ios::binary);
+    std::ofstream locations_ofs(locations_path, std::ios::binary);
+    std::ofstream buckets_ofs(buckets_path, std::ios::binary);
+    // The number of stored randstrobes is known only after the merge if
+    // repetitive runs are dropped. The header is rewritten then; its size
+    // does not depend on that number.
+    auto sections = write_sti_header(ofs, stats.tot_strobemer_count);
+    pad_to(ofs, sections.hashes_offset);
 
-void StrobemerIndex::add_randstrobes_to_vector(int randstrobe_hashes){
-    // size_t tot_occur_once = 0;
-    randstrobes_vector.reserve(randstrobe_hashes);
-    for (size_t ref_index = 0; ref_index < references.size(); ++ref_index) {
-        auto seq = references.sequences[ref_index];
-        if (seq.length() < parameters.w_max) {
-            continue;
-        }
-        auto randstrobe_iter = RandstrobeIterator2(seq, parameters.k, parameters.s, parameters.t_syncmer, parameters.w_min, parameters.w_max, parameters.max_dist);
-        std::vector<Randstrobe> chunk;
-        // TODO
-        // Chunking makes this function faster, but the speedup is achieved even
-        // with a chunk size of 1.
-        const size_t chunk_size = 4;
-        chunk.reserve(chunk_size);
-        bool end = false;
-        while (!end) {
-            // fill chunk
-            Randstrobe randstrobe;
-            while (chunk.size() < chunk_size) {
-                randstrobe = randstrobe_iter.next();
-                if (randstrobe == randstrobe_iter.end()) {
-                    end = true;
-                    break;
-                }
-                chunk.push_back(randstrobe);
+    const uint64_t max_count = ((uint64_t)1 << bits) - 1;
+    const size_t n_buckets = size_t(1) << bits;
+    {
+        ArrayWriter<uint64_t> hashes_writer(ofs, 1 << 16);
+        ArrayWriter<RefRandstrobeLocation> locations_writer(locations_ofs, 1 << 16);
+        ArrayWriter<unsigned int> buckets_writer(buckets_ofs, 1 << 16);
+        unsigned int position = 0;
+        size_t next_bucket = 0;
+        merge_runs(run_paths, run_sizes, reader_buffer_size, [&](std::vector<RefRandstrobeWithHash>& equal_hashes) {
+            unsigned int count = equal_hashes.size();
+            if (!count_separately) {
+                counts.add(count);
             }
-            stats.tot_strobemer_count += chunk.size();
-            for (auto randstrobe : chunk) {
-                RefRandstrobeWithHash::packed_t packed = ref_index << 8;
-                packed = packed + (randstrobe.strobe2_pos - randstrobe.strobe1_pos);
-                // try to insert as direct entry
-                // RandstrobeMapEntry entry{randstrobe.strobe1_pos, packed | 0x8000'0000};
-                randstrobes_vector.push_back(RefRandstrobeWithHash{randstrobe.hash, randstrobe.strobe1_pos, packed});
-                }
-            chunk.clear();
+            size_t bucket = equal_hashes[0].hash >> (64 - bits);
+            for ( ; next_bucket <= bucket; ++next_bucket) {
+                buckets_writer.push_back(position);
             }
+            uint64_t stored_count = std::min(uint64_t(count), max_count);
+            equal_hashes[0].hash = (equal_hashes[0].hash & hash_mask) | (stored_count << (64 - bits));
+            if (is_dropped_count(stored_count)) {
+                equal_hashes.resize(1);
+            }
+            for (auto& randstrobe : equal_hashes) {
+                hashes_writer.push_back(randstrobe.hash);
+                locations_writer.push_back(RefRandstrobeLocation{randstrobe.position, randstrobe.packed});
+            }
+            position += equal_hashes.size();
+        });
+        for ( ; next_bucket <= n_buckets; ++next_bucket) {
+            buckets_writer.push_back(position);
+        }
+        stats.dropped_randstrobes = stats.tot_strobemer_count - position;
+    }
+    locations_ofs.close();
+    buckets_ofs.close();
+    if (!count_separately) {
+        fill_statistics(stats, counts, filter_cutoff);
+        if (filter_fraction > 0) {
+            this->filter_cutoff = filter_cutoff_from_fraction(counts, filter_fraction, stats);
         }
-    // stats.tot_occur_once = tot_occur_once;
+    }
+
+    // Rewrite the header and append the locations and the bucket table
+    auto hashes_end = ofs.tellp();
+    ofs.seekp(0);
+    sections = write_sti_header(ofs, stats.tot_strobemer_count - stats.dropped_randstrobes);
+    ofs.seekp(hashes_end);
+    pad_to(ofs, sections.locations_offset);
+    {
+        std::ifstream locations_ifs(locations_path, std::ios::binary);
+        ofs << locations_ifs.rdbuf();
+    }
+    pad_to(ofs, sections.hash_positions_offset);
+    std::ifstream buckets_ifs(buckets_path, std::ios::binary);
+    ofs << buckets_ifs.rdbuf();
+    ofs.close();
+    if (!ofs) {
+        throw InvalidIndexFile(sti_path + ": error writing index file");
+    }
+
+    stats.elapsed_hash_index = hash_index_timer.duration();
+
+    // The mapping remains valid after the temporary directory is removed
+    read(sti_path);
 }
 
 /*
@@ -448,14 +1081,13 @@ void StrobemerIndex::print_diagnostics(const std::string& logfile_name, int k) c
     uint64_t tot_seed_count_1000_limit = 0;
 
     size_t seed_length = 0;
-    for (auto &it : randstrobe_map) {
-        auto ref_mer = it.second;
-        auto offset = ref_mer.offset();
-        auto count = ref_mer.count();
-
-        for (size_t j = offset; j < offset + count; ++j) {
-            auto r = flat_vector[j];
-            seed_length = r.strobe2_offset() + k;
+    // Entries with the same hash are consecutive and the first one stores their count
+    for (size_t offset = 0; offset < n_randstrobes; ) {
+        auto count = get_count(offset);
+        auto stored_count = get_stored_count(offset);
+
+        for (size_t j = offset; j < offset + stored_count; ++j) {
+            seed_length = strobe2_offset(j) + k;
             if (seed_length < max_size){
                 log_count[seed_length] ++;
                 log_count_squared[seed_length] += count;
@@ -477,6 +1109,7 @@ void StrobemerIndex::print_diagnostics(const std::string& logfile_name, int k) c
         if (count >= 10 && seed_length < max_size) {
             log_repetitive[seed_length]++;
         }
+        offset += stored_count;
     }
 
     // printing
@@ -16,100 +16,12 @@
 #include <cmath>
 #include <iostream>
 #include <cassert>
-#include "robin_hood.h"
+#include <memory>
 #include "exceptions.hpp"
 #include "refs.hpp"
 #include "randstrobes.hpp"
 #include "indexparameters.hpp"
-
-/*
- * This describes where a randstrobe occurs. Info stored:
- * - reference index
- * - position of the first strobe
- * - offset of the second strobe
-*/
-
-class RefRandstrobe {
-public:
-    RefRandstrobe() { }  // TODO should not be needed
-    RefRandstrobe(uint32_t position, uint32_t packed) : position(position), m_packed(packed) {
-    }
-    uint32_t position;
-
-    int reference_index() const {
-        return m_packed >> bit_alloc;
-    }
-
-    int strobe2_offset() const {
-        return m_packed & mask;
-    }
-
-    RefRandstrobeWithHash::packed_t packed() const {
-        return m_packed;
-    }
-
-private:
-    static const int bit_alloc = 8;
-    static const int mask = (1 << bit_alloc) - 1;
-    RefRandstrobeWithHash::packed_t m_packed;
-};
-
-using RefRandstrobeVector = std::vector<RefRandstrobe>;
-
-/*
- * An entry in the randstrobe map that allows retrieval of randstrobe
- * occurrences. To save memory, the entry is either a "direct" or an
- * "indirect" one.
- *
- * - A direct entry is used if the randstrobe occurs only once in the reference.
- *   Then that single occurrence itself is stored and can be retrieved by the
- *   as_ref_randstrobe() method.
- * - An indirect entry is used if the randstrobe has multiple occurrences.
- *   In that case, offset() and count() point to an interval within a second
- *   table (RandstrobeVector).
- */
-class RandstrobeMapEntry {
-public:
-    RandstrobeMapEntry() { }
-    RandstrobeMapEntry(unsigned int offset, unsigned int count) : m_offset(offset), m_count(count) { }
-
-    unsigned int count() const {
-        if (is_direct()) {
-            return 1;
-        } else {
-            return m_count;
-        }
-    }
-
-    unsigned int offset() const{
-        assert(!is_direct());
-        return m_offset;
-    }
-
-    bool is_direct() const {
-        return m_count & 0x8000'0000;
-    }
-
-    RefRandstrobe as_ref_randstrobe() const {  // 将m_count 首位置为0
-        assert(is_direct());
-        return RefRandstrobe{m_offset, m_count & 0x7fff'ffff};
-    }
-
-    void set_count(unsigned int count) {
-        m_count = count;
-    }
-
-    void set_offset(unsigned int offset) {
-        assert(!is_direct());
-        m_offset = offset;
-    }
-
-private:
-    unsigned int m_offset;
-    unsigned int m_count;
-};
-
-using RandstrobeMap = robin_hood::unordered_map<randstrobe_hash_t, RandstrobeMapEntry>;
+#include "mappedfile.hpp"
 
 typedef std::vector<uint64_t> hash_vector; //only used during index generation
 
@@ -124,64 +36,101 @@ struct IndexCreationStatistics {
     unsigned int index_cutoff = 0;
     unsigned int filter_cutoff = 0;
     uint64_t unique_mers = 0;
+    uint64_t dropped_randstrobes = 0;
 
     std::chrono::duration<double> elapsed_hash_index;
     std::chrono::duration<double> elapsed_generating_seeds;
-    std::chrono::duration<double> elapsed_unique_hashes;
     std::chrono::duration<double> elapsed_sorting_seeds;
 };
 
+/*
+ * Where a randstrobe occurs in the reference. The index stores these
+ * separately from the hashes, so that searching for a hash does not need to
+ * load them.
+ */
+struct RefRandstrobeLocation {
+    uint32_t position;
+    RefRandstrobeWithHash::packed_t packed; // packed representation of ref_index and strobe offset
+};
+
+/* Offsets of the sections of an index file */
+struct StiSections {
+    uint64_t hashes_offset;
+    uint64_t locations_offset;
+    uint64_t hash_positions_offset;
+};
+
 struct StrobemerIndex {
     StrobemerIndex(const References& references, const IndexParameters& parameters)
         : filter_cutoff(parameters.filter_cutoff)
         , parameters(parameters)
         , references(references) {}
     unsigned int filter_cutoff = parameters.filter_cutoff; //This also exists in mapping_params
-    RefRandstrobeVector flat_vector;
+    // If nonzero, runs of more than index_cutoff equal hashes are stored as
+    // a single entry (which still has the full count). Such runs are never
+    // used for finding NAMs since index_cutoff is the filter_cutoff at
+    // build time.
+    unsigned int index_cutoff = 0;
     mutable IndexCreationStatistics stats;
 
     void write(const std::string& filename) const;
+    // Size of the index in the .sti format and a version of write() that
+    // writes it to memory (for example, a mapping of a file that cannot be
+    // written to with write(2), such as one on hugetlbfs)
+    uint64_t serialized_size() const;
+    void write(char* data) const;
     void read(const std::string& filename);
-    void populate(int filter_cutoff, size_t n_threads);
+    void populate(int filter_cutoff, size_t n_threads, size_t build_memory = 0, bool drop_repetitive = false, float filter_fraction = 0);
     void print_diagnostics(const std::string& logfile_name, int k) const;
     unsigned int find(uint64_t key) const;
-    static const unsigned int N = 28;  // store N bits in the 
-    static const uint64_t hash_mask = (((uint64_t)1 << (64 - N)) - 1);
-    // RandstrobeMap::const_iterator find(uint64_t key) const {
-    //     return randstrobe_map.find(key);
-    // }
+    void find_all(const QueryRandstrobeVector& query_randstrobes, std::vector<unsigned int>& positions) const;
+    // The top 'bits' bits of a hash select its bucket in hash_positions. In
+    // the first entry of each run of equal hashes, they store the run length.
+    unsigned int bits = 0;
+    uint64_t hash_mask = 0;
+    static unsigned int pick_bits(size_t size);
+    void set_bits(unsigned int b) {
+        bits = b;
+        hash_mask = ((uint64_t)1 << (64 - bits)) - 1;
+    }
 
     uint64_t get_hash(unsigned int position) const {
-        if (position < randstrobes_vector.size()){
-            return randstrobes_vector[position].hash;
+        if (position < n_randstrobes){
+            return hashes[position];
         }else{
             return -1;
         }
     } 
 
     unsigned int get_strob1_position(unsigned int position) const {
-        return randstrobes_vector[position].position;
+        return locations[position].position;
     }
 
     int strobe2_offset(unsigned int position) const {
-        return randstrobes_vector[position].packed & mask;
+        return locations[position].packed & mask;
     }
 
     int reference_index(unsigned int position) const {
-        return randstrobes_vector[position].packed >> bit_alloc;
+        return locations[position].packed >> bit_alloc;
     }
 
     unsigned int get_count(unsigned int position) const {
-        unsigned int count = randstrobes_vector[position].hash >> (64 - N);
+        unsigned int count = hashes[position] >> (64 - bits);
         return count;
     }
 
-    RandstrobeMap::const_iterator end() const {
-        return randstrobe_map.cend();
+    // Number of entries stored for the run of equal hashes starting at position
+    unsigned int get_stored_count(unsigned int position) const {
+        auto count = get_count(position);
+        return is_dropped_count(count) ? 1 : count;
     }
 
-    void add_entry(uint64_t key, unsigned int offset, unsigned int count) {
-        randstrobe_map[key] = RandstrobeMapEntry{offset, count};
+    bool is_dropped_count(uint64_t count) const {
+        return index_cutoff > 0 && count > index_cutoff;
+    }
+
+    size_t size() const {
+        return n_randstrobes;
     }
 
     int k() const {
@@ -190,12 +139,25 @@ struct StrobemerIndex {
 
 private:
     // std::vector<RefRandstrobeWithHash> add_randstrobes_to_hash_table();
-    void add_randstrobes_to_vector(int randstrobe_hashes);
+    void populate_external(int filter_cutoff, size_t n_threads, size_t build_memory, bool drop_repetitive, float filter_fraction);
+    StiSections write_sti_header(std::ostream& os, uint64_t n_randstrobes) const;
+    unsigned int find_in_bucket(uint64_t key, int position_start, int position_end) const;
     const IndexParameters& parameters;
     const References& references;
-    std::vector<RefRandstrobeWithHash> randstrobes_vector;
-    unsigned int* hash_positions = new unsigned int[1 << N](); // the position array used to store the position of the hash in the hash vector;
-    RandstrobeMap randstrobe_map; // k-mer -> (offset in flat_vector, occurence count )
+
+    // Storage for an index generated with populate()
+    std::vector<uint64_t> hashes_vector;
+    std::vector<RefRandstrobeLocation> locations_vector;
+    std::vector<unsigned int> hash_positions_vector;
+    // Storage for an index loaded with read()
+    std::unique_ptr<MappedFile> mapped_file;
+
+    // The index itself. Points into either of the above. Entry i of the index
+    // consists of hashes[i] and locations[i]; they are sorted by hash.
+    const uint64_t* hashes = nullptr;
+    const RefRandstrobeLocation* locations = nullptr;
+    size_t n_randstrobes = 0;
+    const unsigned int* hash_positions = nullptr; // the position array used to store the position of the hash in the hash vector;
     static const int bit_alloc = 8;
     static const int mask = (1 << bit_alloc) - 1;
 };
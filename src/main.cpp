@@ -2,6 +2,7 @@
 #include <fstream>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <algorithm>
 #include <numeric>
@@ -10,12 +11,20 @@
 #include <iomanip>
 #include <chrono>
 #include <unistd.h>
+#include <fcntl.h>
+#include <cerrno>
+#include <cstring>
 
 #include "refs.hpp"
 #include "exceptions.hpp"
 #include "cmdline.hpp"
 #include "index.hpp"
 #include "pc.hpp"
+#include "namfile.hpp"
+#include "bgzfwriter.hpp"
+#include "output.hpp"
+#include "server.hpp"
+#include "sharedindex.hpp"
 // #include "aln.hpp"
 #include "logger.hpp"
 #include "timer.hpp"
@@ -43,6 +52,8 @@ void log_parameters(const IndexParameters& index_parameters, const mapping_param
         << "Maximum seed length: " << index_parameters.max_dist + index_parameters.k << std::endl
         << "C: " << map_param.filter_cutoff << std::endl
         << "L: " << map_param.L << std::endl
+        << "Diagonal band width: " << map_param.diagonal_band_width << std::endl
+        << "Query window: " << map_param.query_window << std::endl
         << "Expected [w_min, w_max] in #syncmers: [" << index_parameters.w_min << ", " << index_parameters.w_max << "]" << std::endl
         << "Expected [w_min, w_max] in #nucleotides: [" << (index_parameters.k - index_parameters.s + 1) * index_parameters.w_min << ", " << (index_parameters.k - index_parameters.s + 1) * index_parameters.w_max << "]" << std::endl;
 }
@@ -55,8 +66,46 @@ bool avx2_enabled() {
 #endif
 }
 
+/* Open the output file, or return the file descriptor of stdout */
+int open_output(const std::string& filename, bool write_to_stdout) {
+    if (write_to_stdout) {
+        return STDOUT_FILENO;
+    }
+    int fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        throw InvalidFile("Could not open output file " + filename + ": " + std::strerror(errno));
+    }
+    return fd;
+}
+
+void close_output(int fd, const std::string& filename) {
+    if (fd != STDOUT_FILENO && ::close(fd) == -1) {
+        throw InvalidFile("Could not write output file " + filename + ": " + std::strerror(errno));
+    }
+}
+
+/* Output is BGZF-compressed if the file name ends in .gz */
+bool is_compressed_output(const std::string& filename) {
+    return filename.size() >= 3 && filename.compare(filename.size() - 3, 3, ".gz") == 0;
+}
+
+/* Write data to fd while no OutputBuffer is writing to it */
+void write_output(int fd, std::string_view data, const std::string& filename) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw InvalidFile("Could not write output file " + filename + ": " + std::strerror(errno));
+        }
+        written += n;
+    }
+}
+
 InputBuffer get_input_buffer(const CommandLineOptions& opt) {
-        return InputBuffer(opt.reads_filename1, opt.chunk_size);
+        return InputBuffer(opt.reads_filename1, opt.chunk_size, opt.n_threads);
 }
 
 
@@ -84,6 +133,11 @@ int run_strobealign(int argc, char **argv) {
     map_param.filter_cutoff = opt.filter_cutoff;
     map_param.L = opt.L;
     map_param.sort_on_scores = opt.sort_on_scores;
+    map_param.diagonal_band_width = opt.diagonal_band_width;
+    map_param.query_window = opt.query_window;
+    map_param.n_threads = opt.n_threads;
+    map_param.binary_output = opt.binary_output;
+    map_param.compress_output = !opt.write_to_stdout && is_compressed_output(opt.output_file_name);
 
     log_parameters(index_parameters, map_param);
     logger.debug() << "Threads: " << opt.n_threads << std::endl;
@@ -92,8 +146,23 @@ int run_strobealign(int argc, char **argv) {
 
     // Create index
     References references;
+    // With --shared-index, the first process builds the index and publishes
+    // it, and the others wait for it and then use the published one
+    std::unique_ptr<SharedIndex> shared_index;
+    bool use_shared_index = false;
+    if (!opt.shared_index.empty()) {
+        shared_index = std::make_unique<SharedIndex>(opt.shared_index);
+        use_shared_index = shared_index->is_published();
+        if (use_shared_index) {
+            shared_index->unlock();
+        }
+    }
     Timer read_refs_timer;
-    references = References::from_fasta(opt.ref_filename);
+    if (use_shared_index) {
+        references = shared_index->references();
+    } else {
+        references = References::from_fasta(opt.ref_filename);
+    }
     logger.info() << "Time reading reference: " << read_refs_timer.elapsed() << " s\n";
 
     logger.info() << "Reference size: " << references.total_length() / 1E6 << " Mbp ("
@@ -105,17 +174,35 @@ int run_strobealign(int argc, char **argv) {
     }
 
     StrobemerIndex index(references, index_parameters);
+    if (use_shared_index) {
+        logger.info() << "Using shared index " << shared_index->path() << '\n';
+        index.read(shared_index->path());
+    } else if (opt.use_index) {
+        // Read the index from a file
+        assert(!opt.only_gen_index);
+        Timer read_index_timer;
+        std::string sti_path = opt.ref_filename + index_parameters.filename_extension();
+        logger.info() << "Reading index from " << sti_path << '\n';
+        index.read(sti_path);
+        logger.info() << "Total time reading index: " << read_index_timer.elapsed() << " s\n";
+    } else {
         logger.info() << "Indexing ...\n";
         Timer index_timer;
         logger.debug() << "FILTER CUTOFF: " << std::to_string(opt.filter_cutoff) << std::endl;
 
-        index.populate(opt.filter_cutoff, opt.n_threads);
+        index.populate(opt.filter_cutoff, opt.n_threads, opt.build_memory, opt.drop_repetitive, opt.filter_fraction);
         
         logger.info() << "  Time generating seeds: " << index.stats.elapsed_generating_seeds.count() << " s" <<  std::endl;
-        logger.info() << "  Time estimating number of unique hashes: " << index.stats.elapsed_unique_hashes.count() << " s" <<  std::endl;
         logger.info() << "  Time sorting non-unique seeds: " << index.stats.elapsed_sorting_seeds.count() << " s" <<  std::endl;
         logger.info() << "  Time generating hash table index: " << index.stats.elapsed_hash_index.count() << " s" <<  std::endl;
         logger.info() << "Total time indexing: " << index_timer.elapsed() << " s\n";
+        if (opt.filter_fraction > 0) {
+            logger.info() << "Filter cutoff derived from --filter-fraction: " << index.filter_cutoff << '\n';
+        }
+        if (opt.drop_repetitive) {
+            logger.info() << "Dropped " << index.stats.dropped_randstrobes << " repetitive randstrobes from the index ("
+                << index.stats.dropped_randstrobes * sizeof(RefRandstrobeWithHash) / 1E6 << " MB saved)\n";
+        }
 
         logger.debug()
         << "Unique strobemers: " << index.stats.unique_mers << std::endl
@@ -133,11 +220,37 @@ int run_strobealign(int argc, char **argv) {
         }
         logger.debug() << "Filtered cutoff index: " << index.stats.index_cutoff << std::endl;
         logger.debug() << "Filtered cutoff count: " << index.stats.filter_cutoff << std::endl;
-        
-        if (!opt.logfile_name.empty()) {
-            index.print_diagnostics(opt.logfile_name, index_parameters.k);
-            logger.debug() << "Finished printing log stats" << std::endl;
+
+        if (opt.only_gen_index) {
+            Timer index_writing_timer;
+            std::string sti_path = opt.ref_filename + index_parameters.filename_extension();
+            logger.info() << "Writing index to " << sti_path << '\n';
+            index.write(sti_path);
+            logger.info() << "Total time writing index: " << index_writing_timer.elapsed() << " s\n";
         }
+        if (shared_index) {
+            // Switch to the published copy so that this process does not
+            // keep its own copy of the index and the reference sequences
+            Timer publish_timer;
+            logger.info() << "Publishing index to " << shared_index->path() << '\n';
+            shared_index->publish(index, references);
+            shared_index->unlock();
+            references = shared_index->references();
+            index.read(shared_index->path());
+            logger.info() << "Total time publishing index: " << publish_timer.elapsed() << " s\n";
+        }
+    }
+    if (!opt.logfile_name.empty()) {
+        index.print_diagnostics(opt.logfile_name, index_parameters.k);
+        logger.debug() << "Finished printing log stats" << std::endl;
+    }
+    if (opt.only_gen_index) {
+        return EXIT_SUCCESS;
+    }
+    if (opt.serve) {
+        serve(opt.socket_path, opt.n_threads, opt.chunk_size, map_param, index_parameters, references, index);
+        return EXIT_SUCCESS;
+    }
 
 
     // Map/align reads
@@ -146,44 +259,41 @@ int run_strobealign(int argc, char **argv) {
 //    map_param.rescue_cutoff = map_param.R < 100 ? map_param.R * index.filter_cutoff : 1000;
 //    logger.debug() << "Using rescue cutoff: " << map_param.rescue_cutoff << std::endl;
 
-    std::streambuf* buf;
-    std::ofstream of;
-
-    if (!opt.write_to_stdout) {
-        of.open(opt.output_file_name);
-        buf = of.rdbuf();
-    }
-    else {
-        buf = std::cout.rdbuf();
+    int out_fd = open_output(opt.output_file_name, opt.write_to_stdout);
+    if (opt.binary_output) {
+        std::string header = nam_file_header(references);
+        if (map_param.compress_output) {
+            std::string compressed;
+            BgzfCompressor().compress(compressed, header);
+            header = std::move(compressed);
+        }
+        write_output(out_fd, header, opt.output_file_name);
     }
 
-    std::ostream out(buf);
-
     std::vector<AlignmentStatistics> log_stats_vec(opt.n_threads);
 
     logger.info() << "Running in " << (opt.is_SE ? "single-end" : "paired-end") << " mode" << std::endl;
 
-    OutputBuffer output_buffer(out);
-
-    std::vector<std::thread> workers;
-    std::vector<int> worker_done(opt.n_threads);  // each thread sets its entry to 1 when it’s done
-    for (int i = 0; i < opt.n_threads; ++i) {
-        std::thread consumer(perform_task, std::ref(input_buffer), std::ref(output_buffer),
-            std::ref(log_stats_vec[i]), std::ref(worker_done[i]),
-            std::ref(map_param), std::ref(index_parameters), std::ref(references),
-            std::ref(index));
-        workers.push_back(std::move(consumer));
-    }
+    // A writer thread writes the output of the workers, in input order
+    // unless --unordered is given
+    OutputBuffer output_buffer(out_fd, 4 * opt.n_threads, !opt.unordered_output);
 
-    for (auto& worker : workers) {
-        worker.join();
+    // A reader thread parses batches of reads ahead of the workers
+    BatchQueue batch_queue(2 * opt.n_threads);
+    map_reads(input_buffer, batch_queue, output_buffer, log_stats_vec, map_param, index_parameters, references, index);
+    output_buffer.close();
+    if (map_param.compress_output) {
+        write_output(out_fd, bgzf_eof_block(), opt.output_file_name);
     }
+    close_output(out_fd, opt.output_file_name);
     logger.info() << "Done!\n";
 
     AlignmentStatistics tot_statistics;
     for (auto& it : log_stats_vec) {
         tot_statistics += it;
     }
+    auto output_statistics = output_buffer.statistics();
+    tot_statistics.tot_write_file = output_statistics.write_time;
 
     logger.info() << "Total mapping sites tried: " << tot_statistics.tot_all_tried << std::endl
         << "Total time mapping: " << map_align_timer.elapsed() << " s." << std::endl
@@ -195,11 +305,72 @@ int run_strobealign(int argc, char **argv) {
     logger.info() << "Total time sorting NAMs (candidate sites): " << tot_statistics.tot_sort_nams.count() / opt.n_threads << " s." << std::endl
         << "Total time base level alignment (ssw): " << tot_statistics.tot_extend.count() / opt.n_threads << " s." << std::endl
         << "Total time writing alignment to files: " << tot_statistics.tot_write_file.count() << " s." << std::endl;
+    auto queue_statistics = batch_queue.statistics();
+    logger.info() << "Read batches queued on average: " << queue_statistics.average_queued() << " of " << queue_statistics.n_batches << std::endl
+        << "Times workers waited for the reader: " << queue_statistics.n_worker_waits << std::endl
+        << "Times the reader waited for workers: " << queue_statistics.n_reader_waits << std::endl;
+    logger.info() << "Output chunks waiting to be written at most: " << output_statistics.max_buffered << std::endl
+        << "Times workers waited for the writer: " << output_statistics.n_worker_waits << std::endl;
+    if (opt.unordered_output) {
+        logger.info() << "Chunks written before an earlier chunk: " << output_statistics.n_early_chunks << std::endl
+            << "Chunks ordered output would have held back at most: " << output_statistics.max_early_chunks
+            << " (" << output_statistics.max_early_bytes / 1E6 << " MB)" << std::endl;
+    }
+    return EXIT_SUCCESS;
+}
+
+/*
+ * namfinder view: convert binary NAM output to the text format or to PAF
+ */
+int run_view(int argc, char **argv) {
+    auto opt = parse_view_arguments(argc, argv);
+    NamFileReader reader(opt.input_file_name);
+    const References& references = reader.references();
+
+    int out_fd = open_output(opt.output_file_name, opt.write_to_stdout);
+    bool compress = !opt.write_to_stdout && is_compressed_output(opt.output_file_name);
+    BgzfCompressor compressor;
+    OutputBuffer output_buffer(out_fd, 4);
+    NamFileChunk chunk;
+    std::vector<Nam> nams;
+    size_t chunk_index = 0;
+    while (reader.read_chunk(chunk)) {
+        std::string out;
+        const auto& records = chunk.nam_records();
+        size_t r = 0;
+        for (size_t i = 0; i < chunk.size(); ++i) {
+            uint64_t read_index = chunk.first_read_index() + i;
+            nams.clear();
+            for (; r < records.size() && records[r].read_index == read_index; ++r) {
+                nams.push_back(nam_from_record(records[r]));
+            }
+            if (opt.paf) {
+                output_nams_paf(out, nams, chunk.name(i), chunk.sequence_length(i), references);
+            } else {
+                output_nams(out, nams, chunk.name(i), references);
+            }
+        }
+        if (compress) {
+            std::string compressed;
+            compressor.compress(compressed, out);
+            out = std::move(compressed);
+        }
+        output_buffer.output_records(std::move(out), chunk_index);
+        chunk_index++;
+    }
+    output_buffer.close();
+    if (compress) {
+        write_output(out_fd, bgzf_eof_block(), opt.output_file_name);
+    }
+    close_output(out_fd, opt.output_file_name);
     return EXIT_SUCCESS;
 }
 
 int main(int argc, char **argv) {
     try {
+        if (argc > 1 && std::string(argv[1]) == "view") {
+            return run_view(argc - 1, argv + 1);
+        }
         return run_strobealign(argc, argv);
     } catch (BadParameter& e) {
         logger.error() << "A mapping or seeding parameter is invalid: " << e.what() << std::endl;
@@ -0,0 +1,66 @@
+#ifndef MAPPEDFILE_HPP
+#define MAPPEDFILE_HPP
+
+#include <string>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "exceptions.hpp"
+
+/*
+ * A file that is mapped read-only into memory. Pages are loaded lazily by
+ * the kernel and are shared with other processes that map the same file.
+ * The mapping is removed by the destructor.
+ */
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& filename) {
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd == -1) {
+            throw InvalidFile(filename + ": " + strerror(errno));
+        }
+        struct stat st;
+        if (fstat(fd, &st) == -1) {
+            int err = errno;
+            close(fd);
+            throw InvalidFile(filename + ": " + strerror(err));
+        }
+        m_size = st.st_size;
+        if (m_size > 0) {
+            void* addr = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (addr == MAP_FAILED) {
+                int err = errno;
+                close(fd);
+                throw InvalidFile(filename + ": cannot map file into memory: " + strerror(err));
+            }
+            m_data = static_cast<const char*>(addr);
+        }
+        close(fd);
+    }
+
+    ~MappedFile() {
+        if (m_data != nullptr) {
+            munmap(const_cast<char*>(m_data), m_size);
+        }
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* data() const {
+        return m_data;
+    }
+
+    size_t size() const {
+        return m_size;
+    }
+
+private:
+    const char* m_data = nullptr;
+    size_t m_size = 0;
+};
+
+#endif
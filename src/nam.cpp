@@ -1,5 +1,8 @@
 #include "nam.hpp"
+#include <algorithm>
 #include "logger.hpp"
+#include "robin_hood.h"
+#include "parallel.hpp"
 
 static Logger& logger = Logger::get();
 namespace {
@@ -12,8 +15,82 @@ struct Hit {
     bool is_rc = false;
 };
 
+int floor_div(int64_t a, int64_t b) {
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+/*
+ * Hits are merged into NAMs separately for each group of hits. Normally, a
+ * group contains the hits to one reference. If diagonal_band_width is
+ * nonzero, the hits to a reference are further split by strand and by
+ * diagonal band (ref_s - query_s). The reference index is stored in the low
+ * 32 bits of the key.
+ */
+uint64_t hit_group_key(unsigned int ref_index, const Hit& hit, int diagonal_band_width) {
+    if (diagonal_band_width == 0) {
+        return ref_index;
+    }
+    int band = floor_div(int64_t(hit.ref_s) - hit.query_s, diagonal_band_width);
+    return (uint64_t(uint32_t(band)) << 32) | (hit.is_rc ? 0x80000000u : 0) | ref_index;
+}
+
+unsigned int hit_group_ref_index(uint64_t key) {
+    return key & 0x7fffffff;
+}
+
+/*
+ * Hits grouped by hit_group_key, with groups in order of their first hit. The
+ * vectors of hits are kept when the groups are cleared so that they can be
+ * reused for the next query.
+ */
+class HitGroups {
+public:
+    void add(uint64_t key, const Hit& hit) {
+        auto it = group_of_key.find(key);
+        unsigned int g;
+        if (it == group_of_key.end()) {
+            g = n_groups++;
+            group_of_key[key] = g;
+            if (g == groups.size()) {
+                groups.emplace_back();
+                keys.emplace_back();
+            }
+            keys[g] = key;
+        } else {
+            g = it->second;
+        }
+        groups[g].push_back(hit);
+    }
+
+    void clear() {
+        for (size_t g = 0; g < n_groups; ++g) {
+            groups[g].clear();
+        }
+        group_of_key.clear();
+        n_groups = 0;
+    }
+
+    size_t size() const {
+        return n_groups;
+    }
+
+    uint64_t key(size_t g) const {
+        return keys[g];
+    }
+
+    std::vector<Hit>& hits(size_t g) {
+        return groups[g];
+    }
+
+private:
+    robin_hood::unordered_map<uint64_t, unsigned int> group_of_key;
+    std::vector<uint64_t> keys;
+    std::vector<std::vector<Hit>> groups;
+    size_t n_groups = 0;
+};
+
 void add_to_hits_per_ref(
-    robin_hood::unordered_map<unsigned int, std::vector<Hit>>& hits_per_ref,
+    HitGroups& hits_per_ref,
     int query_s,
     int query_e,
     bool is_rc,
@@ -21,7 +98,8 @@ void add_to_hits_per_ref(
     // RandstrobeMapEntry randstrobe_map_entry,
     unsigned int position,
     int min_diff,
-    int& tot_hits
+    int& tot_hits,
+    int diagonal_band_width
 ) {
     // Determine whether the hash table’s value directly represents a
     // ReferenceMer (this is the case if count==1) or an offset/count
@@ -33,7 +111,8 @@ void add_to_hits_per_ref(
         int ref_e = ref_s + index.strobe2_offset(position) + index.k();
         int diff = std::abs((query_e - query_s) - (ref_e - ref_s));
         if (diff <= min_diff) {
-            hits_per_ref[index.reference_index(position)].push_back(Hit{query_s, query_e, ref_s, ref_e, is_rc});
+            Hit hit{query_s, query_e, ref_s, ref_e, is_rc};
+            hits_per_ref.add(hit_group_key(index.reference_index(position), hit, diagonal_band_width), hit);
             min_diff = diff;
             tot_hits ++;
         }
@@ -44,7 +123,8 @@ void add_to_hits_per_ref(
             int ref_e = ref_s + index.strobe2_offset(j) + index.k();
             int diff = std::abs((query_e - query_s) - (ref_e - ref_s));
             if (diff <= min_diff) {
-                hits_per_ref[index.reference_index(j)].push_back(Hit{query_s, query_e, ref_s, ref_e, is_rc});
+                Hit hit{query_s, query_e, ref_s, ref_e, is_rc};
+                hits_per_ref.add(hit_group_key(index.reference_index(j), hit, diagonal_band_width), hit);
                 min_diff = diff;
                 tot_hits ++;
             }
@@ -52,145 +132,356 @@ void add_to_hits_per_ref(
     }
 }
 
-std::vector<Nam> merge_hits_into_nams(
-    robin_hood::unordered_map<unsigned int, std::vector<Hit>>& hits_per_ref,
-    int k,
-    bool sort
-) {
-    std::vector<Nam> nams;
-    int nam_id_cnt = 0;
-    for (auto &[ref_id, hits] : hits_per_ref) {
-        if (sort) {
-            std::sort(hits.begin(), hits.end(), [](const Hit& a, const Hit& b) -> bool {
-                    // first sort on query starts, then on reference starts
-                    return (a.query_s < b.query_s) || ( (a.query_s == b.query_s) && (a.ref_s < b.ref_s) );
+/*
+ * The open NAMs of a single reference, indexed such that those that a hit
+ * can extend are found without scanning all of them.
+ *
+ * A hit h can extend an open NAM n if
+ *
+ *   n.query_prev_hit_startpos < h.query_s <= n.query_e and
+ *   n.ref_prev_hit_startpos <= h.ref_s <= n.ref_e.
+ *
+ * The start coordinates of the hits in a NAM are increasing, so
+ * n.query_e - n.query_prev_hit_startpos and n.ref_e - n.ref_prev_hit_startpos
+ * are at most the largest span of any hit (max_span). Then
+ * n.ref_prev_hit_startpos is within max_span of h.ref_s, and the diagonal of
+ * n (ref_prev_hit_startpos - query_prev_hit_startpos) is within max_span of
+ * the diagonal of h. Open NAMs are therefore kept in a grid of cells of
+ * size max_span + 1 (by diagonal and by reference position), and only the
+ * cells around a hit need to be searched.
+ *
+ * NAMs are identified by their index in creation order, which is the order
+ * in which the original list-based implementation tried them.
+ *
+ * An OpenNams can be reused for another group of hits after calling reset(),
+ * which keeps the memory it has allocated.
+ */
+class OpenNams {
+public:
+    void reset(int max_span) {
+        this->max_span = max_span;
+        cell_size = max_span + 1;
+        nams.clear();
+        locations.clear();
+        cells.clear();
+        free_cells.clear();
+        for (unsigned int c = 0; c < cell_members.size(); ++c) {
+            cell_members[c].clear();
+            free_cells.push_back(c);
+        }
+        by_query_end.clear();
+    }
+
+    // Return the first open NAM that h can extend or -1 if there is none
+    int find(const Hit& h) const {
+        const int64_t diagonal = int64_t(h.ref_s) - h.query_s;
+        int found = -1;
+        for (int d = floor_div(diagonal - max_span, cell_size); d <= floor_div(diagonal + max_span, cell_size); ++d) {
+            for (int r = floor_div(std::max(h.ref_s - max_span, 0), cell_size); r <= h.ref_s / cell_size; ++r) {
+                auto cell = cells.find(cell_key(d, r));
+                if (cell == cells.end()) {
+                    continue;
                 }
-            );
-        }
-
-        std::vector<Nam> open_nams;
-        unsigned int prev_q_start = 0;
-        for (auto &h : hits) {
-            bool is_added = false;
-            for (auto & o : open_nams) {
-
-//                // Extend NAM
-//                if (( o.is_rc == h.is_rc) && (o.query_prev_hit_startpos < h.query_s) && (h.query_s <= o.query_e ) && (o.ref_prev_hit_startpos < h.ref_s) && (h.ref_s <= o.ref_e) ){
-//                    if ( (h.query_e > o.query_e) && (h.ref_e > o.ref_e) ) {
-//                        o.query_e = h.query_e;
-//                        o.ref_e = h.ref_e;
-//                        o.query_prev_hit_startpos = h.query_s; // ` the last strobemer hit in case of outputting paf
-//                        o.ref_prev_hit_startpos = h.ref_s; // log the last strobemer hit in case of outputting paf
-//                        o.n_hits ++;
-//                        is_added = true;
-//                        break;
-//                    }
-//                    else if ((h.query_e <= o.query_e) && (h.ref_e <= o.ref_e)) {
-//                        o.query_prev_hit_startpos = h.query_s; // log the last strobemer hit in case of outputting paf
-//                        o.ref_prev_hit_startpos = h.ref_s; // log the last strobemer hit in case of outputting paf
-//                        o.n_hits ++;
-//                        is_added = true;
-//                        break;
-//                    }
-//                }
-
-                // Extend NAM (version from StrobeMap)
-                if ( ( o.query_prev_hit_startpos < h.query_s) && (h.query_s <= o.query_e ) && ( o.ref_prev_hit_startpos <= h.ref_s) && (h.ref_s <= o.ref_e) ){
-
-                    if (h.query_e > o.query_e) {
-                        o.query_e = h.query_e;
-                    }
-                    if (h.ref_e > o.ref_e) {
-                        o.ref_e = h.ref_e;
+                for (auto i : cell_members[cell->second]) {
+                    if ((found == -1 || int(i) < found) && can_extend(nams[i], h)) {
+                        found = i;
                     }
-                    o.query_prev_hit_startpos = h.query_s;
-                    o.ref_prev_hit_startpos = h.ref_s; // keeping track so that we don't . Can be caused by interleaved repeats.
-                    o.n_hits ++;
-                    is_added = true;
-                    break;
                 }
+            }
+        }
+        return found;
+    }
+
+    void extend(int i, const Hit& h) {
+        Nam& n = nams[i];
+        bool query_e_changed = h.query_e > n.query_e;
+        if (h.query_e > n.query_e) {
+            n.query_e = h.query_e;
+        }
+        if (h.ref_e > n.ref_e) {
+            n.ref_e = h.ref_e;
+        }
+        n.query_prev_hit_startpos = h.query_s;
+        n.ref_prev_hit_startpos = h.ref_s; // keeping track so that we don't . Can be caused by interleaved repeats.
+        n.n_hits++;
+        remove_from_cell(i);
+        add_to_cell(i);
+        if (query_e_changed) {
+            push_query_end(n.query_e, i);
+        }
+    }
 
+    void add(const Nam& n) {
+        unsigned int i = nams.size();
+        nams.push_back(n);
+        locations.emplace_back();
+        add_to_cell(i);
+        push_query_end(n.query_e, i);
+    }
+
+    // Move the open NAMs that end before query_s to out
+    void close_passed(int query_s, std::vector<Nam>& out) {
+        passed.clear();
+        while (!by_query_end.empty() && by_query_end.front().first < query_s) {
+            std::pop_heap(by_query_end.begin(), by_query_end.end(), std::greater<>());
+            auto [query_e, i] = by_query_end.back();
+            by_query_end.pop_back();
+            // Skip outdated entries
+            if (locations[i].is_open && nams[i].query_e == query_e) {
+                passed.push_back(i);
+                remove_from_cell(i);
+                locations[i].is_open = false;
             }
-            // Add the hit to open matches
-            if (!is_added){
-                Nam n;
-                n.nam_id = nam_id_cnt;
-                nam_id_cnt ++;
-                n.query_s = h.query_s;
-                n.query_e = h.query_e;
-                n.ref_s = h.ref_s;
-                n.ref_e = h.ref_e;
-                n.ref_id = ref_id;
-//                n.previous_query_start = h.query_s;
-//                n.previous_ref_start = h.ref_s;
-                n.query_prev_hit_startpos = h.query_s;
-                n.ref_prev_hit_startpos = h.ref_s;
-                n.n_hits = 1;
-                n.is_rc = h.is_rc;
-                open_nams.push_back(n);
+        }
+        std::sort(passed.begin(), passed.end());
+        for (auto i : passed) {
+            output(i, out);
+        }
+    }
+
+    void close_all(std::vector<Nam>& out) {
+        for (size_t i = 0; i < nams.size(); ++i) {
+            if (locations[i].is_open) {
+                output(i, out);
             }
+        }
+    }
 
-            // Only filter if we have advanced at least k nucleotides
-            if (h.query_s > prev_q_start + k) {
-
-                // Output all NAMs from open_matches to final_nams that the current hit have passed
-                for (auto &n : open_nams) {
-                    if (n.query_e < h.query_s) {
-//                        int n_max_span = std::max(n.query_span(), n.ref_span());
-//                        int n_min_span = std::min(n.query_span(), n.ref_span());
-//                        double n_score;
-//                        n_score = ( 2*n_min_span -  n_max_span) > 0 ? (double) (n.n_hits * ( 2*n_min_span -  n_max_span) ) : 1;   // this is really just n_hits * ( min_span - (offset_in_span) ) );
-                        n.score = std::min(n.query_span(), n.ref_span());
-                        nams.push_back(n);
-                    }
-                }
+private:
+    struct Location {
+        uint64_t key;
+        size_t slot;
+        bool is_open = true;
+    };
+
+    static bool can_extend(const Nam& n, const Hit& h) {
+        return (n.query_prev_hit_startpos < h.query_s) && (h.query_s <= n.query_e) && (n.ref_prev_hit_startpos <= h.ref_s) && (h.ref_s <= n.ref_e);
+    }
+
+    static uint64_t cell_key(int diagonal_cell, int ref_cell) {
+        return (uint64_t(uint32_t(diagonal_cell)) << 32) | uint32_t(ref_cell);
+    }
 
-                // Remove all NAMs from open_matches that the current hit have passed
-                auto c = h.query_s;
-                auto predicate = [c](decltype(open_nams)::value_type const &nam) { return nam.query_e < c; };
-                open_nams.erase(std::remove_if(open_nams.begin(), open_nams.end(), predicate), open_nams.end());
-                prev_q_start = h.query_s;
+    void add_to_cell(unsigned int i) {
+        const Nam& n = nams[i];
+        auto key = cell_key(
+            floor_div(int64_t(n.ref_prev_hit_startpos) - n.query_prev_hit_startpos, cell_size),
+            n.ref_prev_hit_startpos / cell_size
+        );
+        auto cell = cells.find(key);
+        unsigned int c;
+        if (cell == cells.end()) {
+            if (free_cells.empty()) {
+                free_cells.push_back(cell_members.size());
+                cell_members.emplace_back();
             }
+            c = free_cells.back();
+            free_cells.pop_back();
+            cells[key] = c;
+        } else {
+            c = cell->second;
         }
+        auto& members = cell_members[c];
+        locations[i].key = key;
+        locations[i].slot = members.size();
+        members.push_back(i);
+    }
 
-        // Add all current open_matches to final NAMs
-        for (auto &n : open_nams) {
-//            int n_max_span = std::max(n.query_span(), n.ref_span());
-//            int n_min_span = std::min(n.query_span(), n.ref_span());
-//            double n_score;
-//            n_score = ( 2*n_min_span -  n_max_span) > 0 ? (double) (n.n_hits * ( 2*n_min_span -  n_max_span) ) : 1;   // this is really just n_hits * ( min_span - (offset_in_span) ) );
-//            n.score = n_score;
-            n.score = std::min(n.query_span(), n.ref_span());
-            nams.push_back(n);
+    void remove_from_cell(unsigned int i) {
+        auto cell = cells.find(locations[i].key);
+        auto& members = cell_members[cell->second];
+        auto slot = locations[i].slot;
+        members[slot] = members.back();
+        locations[members[slot]].slot = slot;
+        members.pop_back();
+        if (members.empty()) {
+            free_cells.push_back(cell->second);
+            cells.erase(cell);
+        }
+    }
+
+    void push_query_end(int query_e, unsigned int i) {
+        by_query_end.emplace_back(query_e, i);
+        std::push_heap(by_query_end.begin(), by_query_end.end(), std::greater<>());
+    }
+
+    void output(unsigned int i, std::vector<Nam>& out) {
+        Nam& n = nams[i];
+        n.score = std::min(n.query_span(), n.ref_span());
+        out.push_back(n);
+    }
+
+    int max_span = 0;
+    int cell_size = 1;
+    std::vector<Nam> nams;
+    std::vector<Location> locations;
+    // Maps a cell to its entry in cell_members. Entries of cells that have
+    // become empty are listed in free_cells and reused.
+    robin_hood::unordered_map<uint64_t, unsigned int> cells;
+    std::vector<std::vector<unsigned int>> cell_members;
+    std::vector<unsigned int> free_cells;
+    // Min-heap of open NAMs by query end (may contain outdated entries)
+    std::vector<std::pair<int, unsigned int>> by_query_end;
+    std::vector<unsigned int> passed;
+};
+
+/*
+ * Merge the hits of one group into NAMs, which are appended to nams. For
+ * each hit, the first open NAM (in creation order) that it can extend is
+ * extended. If there is none, a new NAM is opened. Open NAMs are closed once
+ * the hits have advanced past their query end.
+ *
+ * NAM ids are assigned consecutively starting from 0. Return the number of
+ * NAMs created.
+ */
+int merge_hits(std::vector<Hit>& hits, unsigned int ref_id, int k, bool sort, OpenNams& open_nams, std::vector<Nam>& nams) {
+    if (sort) {
+        std::sort(hits.begin(), hits.end(), [](const Hit& a, const Hit& b) -> bool {
+                // first sort on query starts, then on reference starts
+                return (a.query_s < b.query_s) || ( (a.query_s == b.query_s) && (a.ref_s < b.ref_s) );
+            }
+        );
+    }
+
+    int nam_id_cnt = 0;
+    int max_span = 0;
+    for (auto &h : hits) {
+        max_span = std::max({max_span, h.query_e - h.query_s, h.ref_e - h.ref_s});
+    }
+    open_nams.reset(max_span);
+    unsigned int prev_q_start = 0;
+    for (auto &h : hits) {
+        int i = open_nams.find(h);
+        if (i >= 0) {
+            open_nams.extend(i, h);
+        } else {
+            // Add the hit to open matches
+            Nam n;
+            n.nam_id = nam_id_cnt;
+            nam_id_cnt ++;
+            n.query_s = h.query_s;
+            n.query_e = h.query_e;
+            n.ref_s = h.ref_s;
+            n.ref_e = h.ref_e;
+            n.ref_id = ref_id;
+            n.query_prev_hit_startpos = h.query_s;
+            n.ref_prev_hit_startpos = h.ref_s;
+            n.n_hits = 1;
+            n.is_rc = h.is_rc;
+            open_nams.add(n);
+        }
+
+        // Only filter if we have advanced at least k nucleotides
+        if (h.query_s > prev_q_start + k) {
+            // Output all NAMs from open_matches to final_nams that the current hit have passed
+            open_nams.close_passed(h.query_s, nams);
+            prev_q_start = h.query_s;
+        }
+    }
+
+    // Add all current open_matches to final NAMs
+    open_nams.close_all(nams);
+    return nam_id_cnt;
+}
+
+/*
+ * Merge the hits of each group into NAMs, which replace the contents of
+ * nams. If the query has at least PARALLEL_MERGE_MIN_HITS hits, groups are
+ * merged on n_threads threads. The result does not depend on the number of
+ * threads.
+ */
+const size_t PARALLEL_MERGE_MIN_HITS = 100'000;
+
+void merge_hits_into_nams(
+    HitGroups& hits_per_ref,
+    int k,
+    bool sort,
+    size_t n_threads,
+    size_t n_hits,
+    OpenNams& open_nams,
+    std::vector<Nam>& nams
+) {
+    nams.clear();
+    const size_t n_groups = hits_per_ref.size();
+
+    // Make NAM ids unique as if the groups had been merged one after another
+    int nam_id_offset = 0;
+    if (n_threads > 1 && n_groups > 1 && n_hits >= PARALLEL_MERGE_MIN_HITS) {
+        std::vector<std::vector<Nam>> group_nams(n_groups);
+        std::vector<int> n_created(n_groups);
+        run_in_parallel(n_groups, n_threads, [&](size_t g) {
+            OpenNams group_open_nams;
+            unsigned int ref_id = hit_group_ref_index(hits_per_ref.key(g));
+            n_created[g] = merge_hits(hits_per_ref.hits(g), ref_id, k, sort, group_open_nams, group_nams[g]);
+        });
+        for (size_t g = 0; g < n_groups; ++g) {
+            for (auto& nam : group_nams[g]) {
+                nam.nam_id += nam_id_offset;
+                nams.push_back(nam);
+            }
+            nam_id_offset += n_created[g];
+        }
+    } else {
+        for (size_t g = 0; g < n_groups; ++g) {
+            size_t first = nams.size();
+            unsigned int ref_id = hit_group_ref_index(hits_per_ref.key(g));
+            int n_created = merge_hits(hits_per_ref.hits(g), ref_id, k, sort, open_nams, nams);
+            for (size_t i = first; i < nams.size(); ++i) {
+                nams[i].nam_id += nam_id_offset;
+            }
+            nam_id_offset += n_created;
         }
     }
 //    logger.debug() << "NAMS: " << std::to_string(std::size(nams)) << std::endl;
-    return nams;
 }
 
 } // namespace
 
+struct QueryBuffers::MergeBuffers {
+    HitGroups hits_per_ref;
+    OpenNams open_nams;
+};
+
+QueryBuffers::QueryBuffers() : merge_buffers(std::make_unique<MergeBuffers>()) { }
+
+QueryBuffers::~QueryBuffers() = default;
+
+namespace {
+
 /*
- * Find a query’s NAMs, ignoring randstrobes that occur too often in the
- * reference (have a count above filter_cutoff).
+ * Find the NAMs of the query randstrobes, ignoring randstrobes that occur too
+ * often in the reference (have a count above filter_cutoff). The NAMs replace
+ * the contents of nams.
  *
- * Return the fraction of nonrepetitive hits (those not above the filter_cutoff threshold)
+ * total_hits is the number of randstrobes found in the index, and
+ * nr_good_hits the number of those that were not ignored.
  */
-std::pair<float, std::vector<Nam>> find_nams(
+void find_nams_and_count_hits(
     const QueryRandstrobeVector &query_randstrobes,
-    const StrobemerIndex& index
+    const StrobemerIndex& index,
+    int diagonal_band_width,
+    size_t n_threads,
+    QueryBuffers& buffers,
+    std::vector<Nam>& nams,
+    int& nr_good_hits,
+    int& total_hits
 ) {
-    robin_hood::unordered_map<unsigned int, std::vector<Hit>> hits_per_ref;
-    hits_per_ref.reserve(100);
+    HitGroups& hits_per_ref = buffers.merge_buffers->hits_per_ref;
+    hits_per_ref.clear();
 
     /*
     1. Find the hash in the vector
     2. the occur times of the hash value, use a flag 
     3. need to know reference index, strobe1 position, storbe2 - strobe1
     */
-    int nr_good_hits = 0, total_hits = 0, tot_hits = 0;
-    for (const auto &q : query_randstrobes) {
-        unsigned int position = index.find(q.hash);
+    nr_good_hits = 0;
+    total_hits = 0;
+    int tot_hits = 0;
+    std::vector<unsigned int>& positions = buffers.positions;
+    index.find_all(query_randstrobes, positions);
+    for (size_t i = 0; i < query_randstrobes.size(); ++i) {
+        const auto& q = query_randstrobes[i];
+        unsigned int position = positions[i];
         if (position != -1){
             total_hits++;
             unsigned int count = index.get_count(position);
@@ -199,19 +490,214 @@ std::pair<float, std::vector<Nam>> find_nams(
                 continue;
             } 
             nr_good_hits++;
-            add_to_hits_per_ref(hits_per_ref, q.start, q.end, q.is_reverse, index, position, 100'000, tot_hits);
+            add_to_hits_per_ref(hits_per_ref, q.start, q.end, q.is_reverse, index, position, 100'000, tot_hits, diagonal_band_width);
         }
     }
 //    logger.debug() << "add_to_hits_per_ref DONE: " << std::to_string(hits_per_ref.size()) << std::endl;
 //    logger.debug() << "add_to_hits_per_ref TOT count: " << std::to_string(tot_hits) << std::endl;
 
-    float nonrepetitive_fraction = total_hits > 0 ? ((float) nr_good_hits) / ((float) total_hits) : 1.0;
-    auto nams = merge_hits_into_nams(hits_per_ref, index.k(), false);
+    merge_hits_into_nams(hits_per_ref, index.k(), false, n_threads, tot_hits, buffers.merge_buffers->open_nams, nams);
 //    logger.debug() << "merge_hits_into_nams DONE: " << std::to_string(nams.size()) << std::endl;
+}
 
-    return make_pair(nonrepetitive_fraction, nams);
+/*
+ * A long query is split into windows whose NAMs are found separately. NAM b
+ * of a later window (in query order on the strand of the NAM) continues NAM
+ * a of an earlier window if the first hit of b could have extended a had
+ * the hits of both windows been merged together.
+ */
+bool continues_nam(const Nam& a, const Nam& b) {
+    return a.ref_id == b.ref_id && a.is_rc == b.is_rc
+        && (a.query_prev_hit_startpos < b.query_s) && (b.query_s <= a.query_e)
+        && (a.ref_prev_hit_startpos <= b.ref_s) && (b.ref_s <= a.ref_e);
+}
+
+void join_nams(Nam& a, const Nam& b) {
+    a.query_e = std::max(a.query_e, b.query_e);
+    a.ref_e = std::max(a.ref_e, b.ref_e);
+    a.query_prev_hit_startpos = b.query_prev_hit_startpos;
+    a.ref_prev_hit_startpos = b.ref_prev_hit_startpos;
+    a.n_hits += b.n_hits;
+    a.score = std::min(a.query_span(), a.ref_span());
+}
+
+/*
+ * Append the NAMs on one strand of all windows to nams, joining NAMs that
+ * continue across window boundaries. window_starts[j] is the smallest query
+ * coordinate (on that strand) at which a randstrobe of window j starts.
+ */
+void stitch_window_nams(
+    const std::vector<std::vector<Nam>>& window_nams,
+    const std::vector<int>& window_starts,
+    bool is_rc,
+    std::vector<Nam>& nams
+) {
+    // NAMs of earlier windows that may be continued, in creation order
+    std::vector<size_t> open;
+    for (size_t w = 0; w < window_nams.size(); ++w) {
+        size_t j = is_rc ? window_nams.size() - 1 - w : w;
+        open.erase(
+            std::remove_if(open.begin(), open.end(), [&](size_t i) { return nams[i].query_e < window_starts[j]; }),
+            open.end()
+        );
+        const size_t n_open = open.size();
+        int max_query_e = -1;
+        for (auto i : open) {
+            max_query_e = std::max(max_query_e, nams[i].query_e);
+        }
+        for (auto& b : window_nams[j]) {
+            if (b.is_rc != is_rc) {
+                continue;
+            }
+            bool joined = false;
+            if (b.query_s <= max_query_e) {
+                for (size_t o = 0; o < n_open; ++o) {
+                    Nam& a = nams[open[o]];
+                    if (continues_nam(a, b)) {
+                        join_nams(a, b);
+                        max_query_e = std::max(max_query_e, a.query_e);
+                        joined = true;
+                        break;
+                    }
+                }
+            }
+            if (!joined) {
+                open.push_back(nams.size());
+                nams.push_back(b);
+            }
+        }
+    }
+}
+
+} // namespace
+
+/*
+ * Find a query’s NAMs, ignoring randstrobes that occur too often in the
+ * reference (have a count above filter_cutoff).
+ *
+ * If diagonal_band_width is nonzero, hits are grouped by strand and diagonal
+ * band before merging them into NAMs (see hit_group_key), and the groups of
+ * queries with many hits are merged on n_threads threads. NAMs then cannot
+ * extend across band boundaries.
+ *
+ * The NAMs are stored in buffers.nams. Return the fraction of nonrepetitive
+ * hits (those not above the filter_cutoff threshold)
+ */
+float find_nams(
+    const QueryRandstrobeVector &query_randstrobes,
+    const StrobemerIndex& index,
+    QueryBuffers& buffers,
+    int diagonal_band_width,
+    size_t n_threads
+) {
+    int nr_good_hits, total_hits;
+    find_nams_and_count_hits(query_randstrobes, index, diagonal_band_width, n_threads, buffers, buffers.nams, nr_good_hits, total_hits);
+    return total_hits > 0 ? ((float) nr_good_hits) / ((float) total_hits) : 1.0;
+}
+
+std::pair<float, std::vector<Nam>> find_nams(
+    const QueryRandstrobeVector &query_randstrobes,
+    const StrobemerIndex& index,
+    int diagonal_band_width,
+    size_t n_threads
+) {
+    QueryBuffers buffers;
+    float nonrepetitive_fraction = find_nams(query_randstrobes, index, buffers, diagonal_band_width, n_threads);
+    return make_pair(nonrepetitive_fraction, std::move(buffers.nams));
 }
 
+/*
+ * Find the NAMs of a long query by splitting it into windows of about
+ * window_length nucleotides that are processed on n_threads threads.
+ *
+ * The windows start at syncmer resync positions, so their syncmers are
+ * exactly those of the whole query. The randstrobes of a window are those
+ * whose first strobe is in it; their second strobe may be in the next
+ * window. NAMs that cross a window boundary are joined afterwards (see
+ * continues_nam), which gives the same NAMs as find_nams except where hits
+ * from different windows would have been interleaved.
+ */
+std::pair<float, std::vector<Nam>> find_nams_windowed(
+    std::string_view seq,
+    const IndexParameters& parameters,
+    const StrobemerIndex& index,
+    size_t window_length,
+    int diagonal_band_width,
+    size_t n_threads
+) {
+    const size_t k = parameters.k;
+    const size_t read_length = seq.length();
+    std::vector<size_t> boundaries{0};
+    for (size_t start = window_length; start + window_length <= read_length; start += window_length) {
+        size_t resync = find_syncmer_resync_position(seq, start, k, parameters.s);
+        if (resync > boundaries.back() && resync < read_length) {
+            boundaries.push_back(resync);
+        }
+    }
+    boundaries.push_back(read_length);
+    const size_t n_windows = boundaries.size() - 1;
+
+    // Syncmers of each window, then of the whole query
+    std::vector<std::vector<syncmer_hash_t>> window_hashes(n_windows);
+    std::vector<std::vector<unsigned int>> window_positions(n_windows);
+    run_in_parallel(n_windows, n_threads, [&](size_t j) {
+        add_syncmers_in_range(seq, k, parameters.s, parameters.t_syncmer, boundaries[j], boundaries[j + 1], window_hashes[j], window_positions[j]);
+    });
+    std::vector<unsigned int> first_syncmer{0};
+    for (size_t j = 0; j < n_windows; ++j) {
+        first_syncmer.push_back(first_syncmer.back() + window_hashes[j].size());
+    }
+    const unsigned int n_syncmers = first_syncmer.back();
+    std::vector<syncmer_hash_t> string_hashes(n_syncmers);
+    std::vector<unsigned int> pos_to_seq_coordinate(n_syncmers);
+    std::vector<syncmer_hash_t> rc_string_hashes(n_syncmers);
+    std::vector<unsigned int> rc_pos_to_seq_coordinate(n_syncmers);
+    run_in_parallel(n_windows, n_threads, [&](size_t j) {
+        for (size_t i = 0; i < window_hashes[j].size(); ++i) {
+            size_t fwd = first_syncmer[j] + i;
+            size_t rc = n_syncmers - 1 - fwd;
+            string_hashes[fwd] = rc_string_hashes[rc] = window_hashes[j][i];
+            pos_to_seq_coordinate[fwd] = window_positions[j][i];
+            rc_pos_to_seq_coordinate[rc] = read_length - window_positions[j][i] - k;
+        }
+        window_hashes[j] = std::vector<syncmer_hash_t>();
+        window_positions[j] = std::vector<unsigned int>();
+    });
+
+    std::vector<std::vector<Nam>> window_nams(n_windows);
+    std::vector<int> fwd_window_starts(n_windows, 0);
+    std::vector<int> rc_window_starts(n_windows, 0);
+    std::vector<int> nr_good_hits(n_windows, 0);
+    std::vector<int> total_hits(n_windows, 0);
+    run_in_parallel(n_windows, n_threads, [&](size_t j) {
+        unsigned int first = first_syncmer[j];
+        unsigned int last = first_syncmer[j + 1];
+        if (first == last) {
+            return;
+        }
+        fwd_window_starts[j] = pos_to_seq_coordinate[first];
+        rc_window_starts[j] = rc_pos_to_seq_coordinate[n_syncmers - last];
+        QueryBuffers buffers;
+        auto& query_randstrobes = buffers.query_randstrobes;
+        add_query_randstrobes(string_hashes, pos_to_seq_coordinate, parameters.w_min, parameters.w_max, parameters.max_dist, k, first, last, false, query_randstrobes);
+        add_query_randstrobes(rc_string_hashes, rc_pos_to_seq_coordinate, parameters.w_min, parameters.w_max, parameters.max_dist, k, n_syncmers - last, n_syncmers - first, true, query_randstrobes);
+        find_nams_and_count_hits(query_randstrobes, index, diagonal_band_width, 1, buffers, window_nams[j], nr_good_hits[j], total_hits[j]);
+    });
+
+    std::vector<Nam> nams;
+    stitch_window_nams(window_nams, fwd_window_starts, false, nams);
+    stitch_window_nams(window_nams, rc_window_starts, true, nams);
+    for (size_t i = 0; i < nams.size(); ++i) {
+        nams[i].nam_id = i;
+    }
+    int sum_good_hits = 0, sum_total_hits = 0;
+    for (size_t j = 0; j < n_windows; ++j) {
+        sum_good_hits += nr_good_hits[j];
+        sum_total_hits += total_hits[j];
+    }
+    float nonrepetitive_fraction = sum_total_hits > 0 ? ((float) sum_good_hits) / ((float) sum_total_hits) : 1.0;
+    return make_pair(nonrepetitive_fraction, nams);
+}
 
 std::ostream& operator<<(std::ostream& os, const Nam& n) {
     os << "Nam(query: " << n.query_s << ".." << n.query_e << ", ref: " << n.ref_s << ".." << n.ref_e << ", score=" << n.score << ")";
@@ -1,6 +1,7 @@
 #ifndef STROBEALIGN_NAM_HPP
 #define STROBEALIGN_NAM_HPP
 
+#include <memory>
 #include <vector>
 #include "index.hpp"
 #include "randstrobes.hpp"
@@ -30,9 +31,48 @@ struct Nam {
     }
 };
 
+/*
+ * Buffers for finding the NAMs of a query. A worker thread reuses one
+ * instance for all its queries, so that no memory needs to be allocated per
+ * query once the buffers have grown large enough.
+ */
+struct QueryBuffers {
+    QueryBuffers();
+    ~QueryBuffers();
+
+    std::vector<syncmer_hash_t> string_hashes;
+    std::vector<unsigned int> pos_to_seq_coordinate;
+    QueryRandstrobeVector query_randstrobes;
+    std::vector<unsigned int> positions;
+    std::vector<Nam> nams;
+
+    // Hit groups and open NAMs (defined in nam.cpp)
+    struct MergeBuffers;
+    std::unique_ptr<MergeBuffers> merge_buffers;
+};
+
+float find_nams(
+    const QueryRandstrobeVector &query_randstrobes,
+    const StrobemerIndex& index,
+    QueryBuffers& buffers,
+    int diagonal_band_width = 0,
+    size_t n_threads = 1
+);
+
 std::pair<float, std::vector<Nam>> find_nams(
     const QueryRandstrobeVector &query_randstrobes,
-    const StrobemerIndex& index
+    const StrobemerIndex& index,
+    int diagonal_band_width = 0,
+    size_t n_threads = 1
+);
+
+std::pair<float, std::vector<Nam>> find_nams_windowed(
+    std::string_view seq,
+    const IndexParameters& parameters,
+    const StrobemerIndex& index,
+    size_t window_length,
+    int diagonal_band_width,
+    size_t n_threads
 );
 
 
@@ -0,0 +1,171 @@
+#include "namfile.hpp"
+
+#include <sstream>
+#include "exceptions.hpp"
+#include "io.hpp"
+
+static const uint32_t NAM_FILE_FORMAT_VERSION = 1;
+
+namespace {
+
+template <typename T>
+void append_raw(std::string& out, const T* data, size_t n) {
+    out.append(reinterpret_cast<const char*>(data), n * sizeof(T));
+}
+
+}  // namespace
+
+void NamFileChunk::clear(uint64_t first_read_index) {
+    first_index = first_read_index;
+    reads.clear();
+    name_starts.clear();
+    names.clear();
+    records.clear();
+}
+
+void NamFileChunk::add(std::string_view name, size_t sequence_length, const std::vector<Nam>& nams) {
+    uint64_t read_index = first_index + reads.size();
+    reads.push_back(ReadEntry{uint32_t(name.size()), uint32_t(sequence_length)});
+    name_starts.push_back(names.size());
+    names.append(name);
+    for (const auto& n : nams) {
+        NamRecord record{};
+        record.read_index = read_index;
+        record.ref_id = n.ref_id;
+        record.ref_start = n.ref_s;
+        record.query_start = n.query_s;
+        record.ref_length = n.ref_e - n.ref_s;
+        record.query_length = n.query_e - n.query_s;
+        record.n_hits = n.n_hits;
+        record.score = n.score;
+        record.is_rc = n.is_rc;
+        records.push_back(record);
+    }
+}
+
+void NamFileChunk::append_to(std::string& out) const {
+    Header header{first_index, reads.size(), records.size(), names.size()};
+    out.reserve(out.size() + sizeof(header) + reads.size() * sizeof(ReadEntry) + names.size() + records.size() * sizeof(NamRecord));
+    append_raw(out, &header, 1);
+    append_raw(out, reads.data(), reads.size());
+    out.append(names);
+    append_raw(out, records.data(), records.size());
+}
+
+std::string nam_file_header(const References& references) {
+    std::ostringstream os;
+    os.write("NAM\1", 4); // Magic number
+    write_int_to_ostream(os, NAM_FILE_FORMAT_VERSION);
+    uint32_t n_references = references.size();
+    os.write(reinterpret_cast<const char*>(&n_references), sizeof(n_references));
+    for (size_t i = 0; i < references.size(); ++i) {
+        uint32_t lengths[2] = {references.lengths[i], uint32_t(references.names[i].size())};
+        os.write(reinterpret_cast<const char*>(lengths), sizeof(lengths));
+        os.write(references.names[i].data(), references.names[i].size());
+    }
+    return os.str();
+}
+
+Nam nam_from_record(const NamRecord& record) {
+    Nam nam;
+    nam.nam_id = 0;
+    nam.ref_id = record.ref_id;
+    nam.ref_s = record.ref_start;
+    nam.ref_e = record.ref_start + record.ref_length;
+    nam.query_s = record.query_start;
+    nam.query_e = record.query_start + record.query_length;
+    nam.query_prev_hit_startpos = 0;
+    nam.ref_prev_hit_startpos = 0;
+    nam.n_hits = record.n_hits;
+    nam.score = record.score;
+    nam.is_rc = record.is_rc;
+    return nam;
+}
+
+NamFileReader::NamFileReader(const std::string& filename)
+    : filename(filename), file(std::make_unique<GzipReader>(filename)) {
+    union {
+        char s[4];
+        uint32_t v;
+    } magic;
+    if (read(magic.s, 4) != 4 || magic.v != 0x014d414e) { // "NAM\1"
+        throw InvalidFile(filename + " is not a binary NAM file (magic number mismatch)");
+    }
+    uint32_t file_format_version;
+    read_exactly(&file_format_version, sizeof(file_format_version));
+    if (file_format_version != NAM_FILE_FORMAT_VERSION) {
+        std::stringstream s;
+        s << "Can only read NAM file format version " << NAM_FILE_FORMAT_VERSION
+            << ", but found version " << file_format_version;
+        throw InvalidFile(s.str());
+    }
+
+    uint32_t n_references;
+    read_exactly(&n_references, sizeof(n_references));
+    std::vector<std::string> names;
+    std::vector<unsigned int> lengths;
+    for (uint32_t i = 0; i < n_references; ++i) {
+        uint32_t header[2];
+        read_exactly(header, sizeof(header));
+        std::string name(header[1], '\0');
+        read_exactly(name.data(), name.size());
+        lengths.push_back(header[0]);
+        names.push_back(std::move(name));
+    }
+    refs = References::without_sequences(std::move(names), lengths);
+}
+
+size_t NamFileReader::read(void* buffer, size_t length) {
+    auto p = static_cast<char*>(buffer);
+    size_t n_read = 0;
+    while (n_read < length) {
+        size_t n = file->read(p + n_read, length - n_read);
+        if (n == 0) {
+            break;
+        }
+        n_read += n;
+    }
+    return n_read;
+}
+
+void NamFileReader::read_exactly(void* buffer, size_t length) {
+    if (read(buffer, length) != length) {
+        throw InvalidFile(filename + ": NAM file is truncated");
+    }
+}
+
+bool NamFileReader::read_chunk(NamFileChunk& chunk) {
+    NamFileChunk::Header header;
+    size_t n = read(&header, sizeof(header));
+    if (n == 0) {
+        return false;
+    }
+    if (n != sizeof(header)) {
+        throw InvalidFile(filename + ": NAM file is truncated");
+    }
+    chunk.clear(header.first_read_index);
+    chunk.reads.resize(header.n_reads);
+    read_exactly(chunk.reads.data(), header.n_reads * sizeof(NamFileChunk::ReadEntry));
+    chunk.names.resize(header.names_length);
+    read_exactly(chunk.names.data(), header.names_length);
+    chunk.records.resize(header.n_records);
+    read_exactly(chunk.records.data(), header.n_records * sizeof(NamRecord));
+
+    size_t start = 0;
+    for (const auto& read : chunk.reads) {
+        chunk.name_starts.push_back(start);
+        start += read.name_length;
+    }
+    if (start != chunk.names.size()) {
+        throw InvalidFile(filename + ": NAM file is corrupt (read names do not match the read table)");
+    }
+    uint64_t read_index = header.first_read_index;
+    for (const auto& record : chunk.records) {
+        if (record.read_index < read_index || record.read_index >= header.first_read_index + header.n_reads
+            || record.ref_id >= refs.size()) {
+            throw InvalidFile(filename + ": NAM file is corrupt (invalid read index or reference id)");
+        }
+        read_index = record.read_index;
+    }
+    return true;
+}
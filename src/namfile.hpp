@@ -0,0 +1,126 @@
+#ifndef NAMFILE_HPP
+#define NAMFILE_HPP
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "gzipreader.hpp"
+#include "nam.hpp"
+#include "refs.hpp"
+
+/*
+ * Binary NAM output
+ *
+ * A NAM file starts with a header:
+ * - magic number "NAM\1" and file format version
+ * - number of references, then for each reference its length and the length
+ *   of its name (uint32_t each) followed by the name
+ *
+ * The rest of the file is a sequence of chunks, one per chunk of reads. In
+ * --unordered mode, chunks are not necessarily in input order. A chunk has:
+ * - a header (NamFileChunk::Header)
+ * - a table with the name length and sequence length of each read
+ * - the read names, concatenated
+ * - the NAMs of all reads as fixed-size NamRecords, grouped by read in the
+ *   same order as the table
+ *
+ * Integers are stored in host byte order, as in the .sti index.
+ */
+
+struct NamRecord {
+    uint64_t read_index;  // 0-based index of the read in the input
+    uint32_t ref_id;
+    uint32_t ref_start;
+    uint32_t query_start;
+    uint32_t ref_length;
+    uint32_t query_length;
+    uint32_t n_hits;
+    int32_t score;
+    uint8_t is_rc;
+    uint8_t padding[3];
+};
+
+static_assert(sizeof(NamRecord) == 40, "NamRecord must not have implicit padding");
+
+/*
+ * The reads and NAMs of one chunk of a NAM file. Workers fill a chunk with
+ * add() and serialize it with append_to(); NamFileReader fills it from a file.
+ */
+class NamFileChunk {
+public:
+    struct Header {
+        uint64_t first_read_index;
+        uint64_t n_reads;
+        uint64_t n_records;
+        uint64_t names_length;
+    };
+
+    struct ReadEntry {
+        uint32_t name_length;
+        uint32_t sequence_length;
+    };
+
+    void clear(uint64_t first_read_index);
+    void add(std::string_view name, size_t sequence_length, const std::vector<Nam>& nams);
+    void append_to(std::string& out) const;
+
+    size_t size() const {
+        return reads.size();
+    }
+    uint64_t first_read_index() const {
+        return first_index;
+    }
+    std::string_view name(size_t i) const {
+        return std::string_view(names).substr(name_starts[i], reads[i].name_length);
+    }
+    uint32_t sequence_length(size_t i) const {
+        return reads[i].sequence_length;
+    }
+    const std::vector<NamRecord>& nam_records() const {
+        return records;
+    }
+
+private:
+    friend class NamFileReader;
+
+    uint64_t first_index{0};
+    std::vector<ReadEntry> reads;
+    std::vector<size_t> name_starts;
+    std::string names;
+    std::vector<NamRecord> records;
+};
+
+/* Return the header of a NAM file for the given references */
+std::string nam_file_header(const References& references);
+
+Nam nam_from_record(const NamRecord& record);
+
+/*
+ * Reads a NAM file written with --binary, which may be compressed. Throws
+ * InvalidFile if the file is not a NAM file or is truncated.
+ */
+class NamFileReader {
+public:
+    explicit NamFileReader(const std::string& filename);
+
+    // Reference names and lengths; the sequences are empty
+    const References& references() const {
+        return refs;
+    }
+
+    // Read the next chunk. Return false at the end of the file.
+    bool read_chunk(NamFileChunk& chunk);
+
+private:
+    // Read up to length bytes; return the number of bytes read
+    size_t read(void* buffer, size_t length);
+    void read_exactly(void* buffer, size_t length);
+
+    std::string filename;
+    std::unique_ptr<GzipReader> file;
+    References refs;
+};
+
+#endif
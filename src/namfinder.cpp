@@ -0,0 +1,47 @@
+#include "namfinder.hpp"
+
+#include "aln.hpp"
+
+IndexHandle::IndexHandle(References references, const IndexParameters& parameters, const FindNamsParameters& find_parameters)
+    : refs(std::make_unique<References>(std::move(references)))
+    , index_params(std::make_unique<IndexParameters>(parameters))
+    , idx(std::make_unique<StrobemerIndex>(*refs, *index_params))
+    , find_params(find_parameters)
+{
+    if (refs->total_length() == 0) {
+        throw InvalidFasta("No reference sequences found");
+    }
+}
+
+IndexHandle IndexHandle::build(References references, const IndexParameters& parameters, size_t n_threads, const FindNamsParameters& find_parameters) {
+    IndexHandle handle(std::move(references), parameters, find_parameters);
+    handle.idx->populate(parameters.filter_cutoff, n_threads);
+    return handle;
+}
+
+IndexHandle IndexHandle::build(const std::string& ref_filename, const IndexParameters& parameters, size_t n_threads, const FindNamsParameters& find_parameters) {
+    return build(References::from_fasta(ref_filename), parameters, n_threads, find_parameters);
+}
+
+IndexHandle IndexHandle::load(const std::string& ref_filename, const IndexParameters& parameters, const FindNamsParameters& find_parameters) {
+    IndexHandle handle(References::from_fasta(ref_filename), parameters, find_parameters);
+    handle.idx->read(ref_filename + parameters.filename_extension());
+    return handle;
+}
+
+void IndexHandle::find_nams(std::string_view sequence, QueryBuffers& buffers) const {
+    mapping_params map_param;
+    map_param.L = find_params.L;
+    map_param.sort_on_scores = find_params.sort_on_scores;
+    map_param.diagonal_band_width = find_params.diagonal_band_width;
+    map_param.query_window = find_params.query_window;
+    map_param.n_threads = find_params.n_threads;
+    AlignmentStatistics statistics;
+    find_read_nams(ReadRecord{std::string_view(), sequence}, statistics, map_param, *index_params, *idx, buffers);
+}
+
+std::vector<Nam> IndexHandle::find_nams(std::string_view sequence) const {
+    static thread_local QueryBuffers buffers;
+    find_nams(sequence, buffers);
+    return buffers.nams;
+}
@@ -0,0 +1,75 @@
+#ifndef NAMFINDER_HPP
+#define NAMFINDER_HPP
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "index.hpp"
+#include "indexparameters.hpp"
+#include "nam.hpp"
+#include "refs.hpp"
+
+/*
+ * Library interface for finding NAMs from within another program
+ *
+ *     IndexParameters parameters(20, 16, 0, 7, 255, 1000);
+ *     auto handle = IndexHandle::build("ref.fa", parameters, n_threads);
+ *     std::vector<Nam> nams = handle.find_nams(sequence);
+ *
+ * find_nams() only reads the index, so a single handle can be shared by
+ * any number of threads.
+ */
+
+// How NAMs are found and which are returned. The defaults are those of the
+// namfinder command.
+struct FindNamsParameters {
+    int L { 1000 };  // return at most L NAMs, those with the highest score
+    bool sort_on_scores { false };  // sort by score instead of by ref_id and coordinates
+    int diagonal_band_width { 0 };
+    int query_window { 250000 };
+    int n_threads { 1 };  // threads used for a single long query
+};
+
+class IndexHandle {
+public:
+    // Build the index for references in memory or in a FASTA file
+    static IndexHandle build(References references, const IndexParameters& parameters, size_t n_threads = 1, const FindNamsParameters& find_parameters = FindNamsParameters());
+    static IndexHandle build(const std::string& ref_filename, const IndexParameters& parameters, size_t n_threads = 1, const FindNamsParameters& find_parameters = FindNamsParameters());
+
+    // Memory-map the index that "namfinder --create-index" wrote for the
+    // FASTA file. The FASTA file is still read for the reference names.
+    static IndexHandle load(const std::string& ref_filename, const IndexParameters& parameters, const FindNamsParameters& find_parameters = FindNamsParameters());
+
+    // Return the NAMs of the sequence in the order the namfinder command
+    // would output them
+    std::vector<Nam> find_nams(std::string_view sequence) const;
+
+    // Same, but leave the NAMs in buffers.nams, which avoids allocating
+    // memory when the buffers are reused
+    void find_nams(std::string_view sequence, QueryBuffers& buffers) const;
+
+    const References& references() const {
+        return *refs;
+    }
+
+    const StrobemerIndex& index() const {
+        return *idx;
+    }
+
+    const FindNamsParameters& find_parameters() const {
+        return find_params;
+    }
+
+private:
+    IndexHandle(References references, const IndexParameters& parameters, const FindNamsParameters& find_parameters);
+
+    // Kept on the heap because the index refers to the references and the
+    // parameters, and the handle should be movable
+    std::unique_ptr<References> refs;
+    std::unique_ptr<IndexParameters> index_params;
+    std::unique_ptr<StrobemerIndex> idx;
+    FindNamsParameters find_params;
+};
+
+#endif
@@ -1,3 +1,4 @@
+#include <charconv>
 #include "output.hpp"
 
 /* PAF columns (see https://github.com/lh3/miniasm/blob/master/PAF.md):
@@ -55,23 +56,87 @@
 //}
 
 
-void output_nams(std::string &nam_output, const std::vector<Nam> &nams, std::string query_name, const References& references) {
+namespace {
 
-    // the +1 are because 1-indexed coordinate system in utput file
+template <typename T>
+void append_number(std::string& out, T value) {
+    char buffer[16];
+    auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    out.append(buffer, result.ptr);
+}
+
+// Append "  refname ref_start query_start length\n". The +1 are because the
+// output uses 1-based coordinates.
+void append_nam(std::string& out, const Nam& n, const References& references) {
+    out.append("  ");
+    out.append(references.names[n.ref_id]);
+    out.push_back(' ');
+    append_number(out, n.ref_s + 1);
+    out.push_back(' ');
+    append_number(out, n.query_s + 1);
+    out.push_back(' ');
+    append_number(out, n.ref_e - n.ref_s);
+    out.push_back('\n');
+}
+
+}  // namespace
+
+void output_nams(std::string &nam_output, const std::vector<Nam> &nams, std::string_view query_name, const References& references) {
+    // Reserve room for the headers and all lines up front. Reference names
+    // are appended straight from references.names and numbers are formatted
+    // with to_chars, so no temporary strings are created.
+    size_t names_length = 0;
+    for (const auto& n : nams) {
+        names_length += references.names[n.ref_id].size();
+    }
+    nam_output.reserve(nam_output.size() + 2 * query_name.size() + 14 + names_length + 36 * nams.size());
 
     // Output results forward
-    nam_output.append("> " + query_name + "\n");
-    for (auto n: nams ){
-        if (!n.is_rc){
-            nam_output.append("  " + references.names[n.ref_id]  + " " + std::to_string(n.ref_s+1)  + " " + std::to_string(n.query_s+1) + " " + std::to_string(n.ref_e - n.ref_s) + "\n");
+    nam_output.append("> ");
+    nam_output.append(query_name);
+    nam_output.append("\n");
+    for (const auto& n : nams) {
+        if (!n.is_rc) {
+            append_nam(nam_output, n, references);
         }
     }
 
     // Output results reverse
-    nam_output.append("> " + query_name + " Reverse\n");
-    for (auto n: nams ){
-        if (n.is_rc){
-            nam_output.append("  " + references.names[n.ref_id]  + " " + std::to_string(n.ref_s+1)  + " " + std::to_string(n.query_s+1) + " " + std::to_string(n.ref_e - n.ref_s) + "\n");
+    nam_output.append("> ");
+    nam_output.append(query_name);
+    nam_output.append(" Reverse\n");
+    for (const auto& n : nams) {
+        if (n.is_rc) {
+            append_nam(nam_output, n, references);
         }
     }
-}
\ No newline at end of file
+}
+
+void output_nams_paf(std::string &paf_output, const std::vector<Nam> &nams, std::string_view query_name, size_t query_length, const References& references) {
+    for (const auto& n : nams) {
+        // NAMs on the reverse strand have coordinates on the reverse
+        // complement of the query, but PAF uses forward coordinates
+        int query_start = n.is_rc ? query_length - n.query_e : n.query_s;
+        int query_end = n.is_rc ? query_length - n.query_s : n.query_e;
+        paf_output.append(query_name);
+        paf_output.push_back('\t');
+        append_number(paf_output, query_length);
+        paf_output.push_back('\t');
+        append_number(paf_output, query_start);
+        paf_output.push_back('\t');
+        append_number(paf_output, query_end);
+        paf_output.append(n.is_rc ? "\t-\t" : "\t+\t");
+        paf_output.append(references.names[n.ref_id]);
+        paf_output.push_back('\t');
+        append_number(paf_output, references.lengths[n.ref_id]);
+        paf_output.push_back('\t');
+        append_number(paf_output, n.ref_s);
+        paf_output.push_back('\t');
+        append_number(paf_output, n.ref_e);
+        paf_output.push_back('\t');
+        append_number(paf_output, n.n_hits);
+        paf_output.push_back('\t');
+        append_number(paf_output, n.ref_e - n.ref_s);
+        paf_output.append("\t255\n");
+    }
+}
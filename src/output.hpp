@@ -2,6 +2,7 @@
 #define STROBEALIGN_OUTPUT_HPP
 
 #include <string>
+#include <string_view>
 #include "refs.hpp"
 #include "nam.hpp"
 
@@ -13,6 +14,12 @@
 //    std::string &paf_output, const std::vector<Nam> &all_nams, const std::string& query_name, const References& references, int k, int read_len
 //);
 
-void output_nams(std::string &nam_output, const std::vector<Nam> &nams, std::string query_name, const References& references);
+void output_nams(std::string &nam_output, const std::vector<Nam> &nams, std::string_view query_name, const References& references);
+
+/*
+ * Write one PAF line per NAM. Column 10 (number of matches) is the number
+ * of hits and column 11 the length of the NAM on the reference.
+ */
+void output_nams_paf(std::string &paf_output, const std::vector<Nam> &nams, std::string_view query_name, size_t query_length, const References& references);
 
 #endif
@@ -0,0 +1,36 @@
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+/*
+ * Run task(i) for all i in [0, n_tasks) on n_threads worker threads. Tasks
+ * are handed out in order, one at a time.
+ */
+template <typename F>
+void run_in_parallel(size_t n_tasks, size_t n_threads, F task) {
+    std::vector<std::thread> workers;
+    std::atomic_size_t task_index = 0;
+    for (size_t i = 0; i < std::min(n_threads, n_tasks); ++i) {
+        workers.push_back(
+            std::thread(
+                [&]() {
+                    while (true) {
+                        size_t j = task_index.fetch_add(1);
+                        if (j >= n_tasks) {
+                            break;
+                        }
+                        task(j);
+                    }
+                })
+        );
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+}
+
+#endif
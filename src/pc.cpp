@@ -14,6 +14,12 @@
 #include "robin_hood.h"
 #include "index.hpp"
 #include "kseq++.hpp"
+#include "namfile.hpp"
+#include "bgzfwriter.hpp"
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <sys/uio.h>
 
 // distribute_interleaved implements the 'interleaved' format:
 // If two consequent reads have the same name, they are considered to be a pair.
@@ -52,24 +58,31 @@ void distribute_interleaved(
 }
 
 
-size_t InputBuffer::read_records(std::vector<klibpp::KSeq> &records3,
+size_t InputBuffer::read_records(ReadBatch &batch,
         int to_read) {
     Timer timer;
 //    records1.clear();
 //    records2.clear();
-    records3.clear();
+    batch.clear();
     // Acquire a unique lock on the mutex
     std::unique_lock<std::mutex> unique_lock(mtx);
     if (to_read == -1) {
         to_read = chunk_size;
     }
 
-    records3 = ks1->stream().read(to_read);
+    auto& stream = ks1->stream();
+    for (int i = 0; i < to_read; ++i) {
+        if (!(stream >> record)) {
+            break;
+        }
+        batch.add(record);
+    }
+    ks1->check_error();
 
     size_t current_chunk_index = chunk_index;
     chunk_index++;
 
-    if (records3.empty()) {
+    if (batch.empty()) {
         finished_reading = true;
     }
 
@@ -87,27 +100,273 @@ void InputBuffer::rewind_reset() {
     chunk_index = 0;
 }
 
+size_t BatchQueue::get_empty() {
+    std::unique_lock<std::mutex> unique_lock(mtx);
+    if (empty_batches.empty()) {
+        stats.n_reader_waits++;
+        cv_empty.wait(unique_lock, [this]{ return !empty_batches.empty(); });
+    }
+    size_t i = empty_batches.front();
+    empty_batches.pop();
+    return i;
+}
+
+void BatchQueue::push(size_t i) {
+    std::unique_lock<std::mutex> unique_lock(mtx);
+    queued_batches.push(i);
+    stats.n_reads += batches[i].reads.size();
+    unique_lock.unlock();
+    cv_queued.notify_one();
+}
+
+void BatchQueue::close(std::exception_ptr error) {
+    std::unique_lock<std::mutex> unique_lock(mtx);
+    closed = true;
+    this->error = error;
+    unique_lock.unlock();
+    cv_queued.notify_all();
+}
+
+bool BatchQueue::pop(size_t& i) {
+    std::unique_lock<std::mutex> unique_lock(mtx);
+    if (queued_batches.empty() && !closed) {
+        stats.n_worker_waits++;
+        cv_queued.wait(unique_lock, [this]{ return !queued_batches.empty() || closed; });
+    }
+    if (queued_batches.empty()) {
+        return false;
+    }
+    stats.n_popped++;
+    stats.sum_queued += queued_batches.size();
+    i = queued_batches.front();
+    queued_batches.pop();
+    return true;
+}
+
+void BatchQueue::put_empty(size_t i) {
+    std::unique_lock<std::mutex> unique_lock(mtx);
+    empty_batches.push(i);
+    unique_lock.unlock();
+    cv_empty.notify_one();
+}
+
+BatchQueue::Statistics BatchQueue::statistics() {
+    std::unique_lock<std::mutex> unique_lock(mtx);
+    Statistics s = stats;
+    s.n_batches = batches.size();
+    return s;
+}
+
+void BatchQueue::check_error() {
+    std::unique_lock<std::mutex> unique_lock(mtx);
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+/*
+ * Parse chunks of reads into the batches of the queue until the input is
+ * exhausted. Run by the reader thread.
+ */
+void read_batches(InputBuffer& input_buffer, BatchQueue& queue) {
+    try {
+        uint64_t n_reads = 0;
+        while (true) {
+            size_t i = queue.get_empty();
+            auto& batch = queue.batch(i);
+            batch.chunk_index = input_buffer.read_records(batch.reads);
+            if (batch.reads.empty()) {
+                queue.put_empty(i);
+                break;
+            }
+            batch.first_read_index = n_reads;
+            n_reads += batch.reads.size();
+            queue.push(i);
+        }
+    } catch (...) {
+        queue.close(std::current_exception());
+        return;
+    }
+    queue.close();
+}
+
+namespace {
+
+/* Write all chunks with as few writev(2) calls as possible */
+void write_fully(int fd, const std::vector<std::string>& chunks) {
+    std::vector<iovec> iov;
+    for (const auto& chunk : chunks) {
+        if (!chunk.empty()) {
+            iov.push_back(iovec{const_cast<char*>(chunk.data()), chunk.size()});
+        }
+    }
+    size_t first = 0;
+    while (first < iov.size()) {
+        int n_iov = std::min(iov.size() - first, size_t(IOV_MAX));
+        ssize_t written = writev(fd, iov.data() + first, n_iov);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw std::runtime_error(std::string("Could not write output: ") + std::strerror(errno));
+        }
+        // Skip what has been written
+        size_t n = written;
+        while (first < iov.size() && n >= iov[first].iov_len) {
+            n -= iov[first].iov_len;
+            first++;
+        }
+        if (n > 0) {
+            iov[first].iov_base = static_cast<char*>(iov[first].iov_base) + n;
+            iov[first].iov_len -= n;
+        }
+    }
+}
+
+} // namespace
+
+OutputBuffer::OutputBuffer(int fd, size_t window_size, bool ordered)
+    : fd(fd)
+    , ordered(ordered)
+    , window(window_size)
+    , filled(window_size, false)
+    , writer(&OutputBuffer::write_chunks, this) {
+}
+
+OutputBuffer::~OutputBuffer() {
+    if (writer.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            closing = true;
+        }
+        cv_chunk.notify_all();
+        writer.join();
+    }
+}
+
 void OutputBuffer::output_records(std::string chunk, size_t chunk_index) {
     std::unique_lock<std::mutex> unique_lock(mtx);
+    record_arrival(chunk_index, chunk.size());
+
+    if (!ordered) {
+        if (unordered_chunks.size() >= window.size()) {
+            stats.n_worker_waits++;
+            cv_space.wait(unique_lock, [&]{ return unordered_chunks.size() < window.size(); });
+        }
+        unordered_chunks.push_back(std::move(chunk));
+        stats.max_buffered = std::max(stats.max_buffered, unordered_chunks.size());
+        unique_lock.unlock();
+        cv_chunk.notify_one();
+        return;
+    }
+
+    // Ensure we print the chunks in the order in which they were read. The
+    // chunk with index next_chunk_index always fits, so this cannot deadlock.
+    if (chunk_index >= next_chunk_index + window.size()) {
+        stats.n_worker_waits++;
+        cv_space.wait(unique_lock, [&]{ return chunk_index < next_chunk_index + window.size(); });
+    }
+    size_t slot = chunk_index % window.size();
+    assert(!filled[slot]);
+    window[slot] = std::move(chunk);
+    filled[slot] = true;
+    n_buffered++;
+    stats.max_buffered = std::max(stats.max_buffered, n_buffered);
+    unique_lock.unlock();
+    cv_chunk.notify_one();
+}
 
-    // Ensure we print the chunks in the order in which they were read
-    assert(chunks.count(chunk_index) == 0);
-    chunks.emplace(std::make_pair(chunk_index, chunk));
+/*
+ * Keep track of the chunks that ordered output would need to hold back
+ * because a chunk with a smaller index has not arrived yet
+ */
+void OutputBuffer::record_arrival(size_t chunk_index, size_t size) {
+    if (chunk_index != next_arriving_index) {
+        stats.n_early_chunks++;
+        early_chunks.emplace(chunk_index, size);
+        early_bytes += size;
+        stats.max_early_chunks = std::max(stats.max_early_chunks, early_chunks.size());
+        stats.max_early_bytes = std::max(stats.max_early_bytes, early_bytes);
+        return;
+    }
+    next_arriving_index++;
+    while (!early_chunks.empty() && early_chunks.begin()->first == next_arriving_index) {
+        early_bytes -= early_chunks.begin()->second;
+        early_chunks.erase(early_chunks.begin());
+        next_arriving_index++;
+    }
+}
+
+bool OutputBuffer::has_chunk_to_write() const {
+    return ordered ? bool(filled[next_chunk_index % window.size()]) : !unordered_chunks.empty();
+}
+
+/*
+ * Run by the writer thread: write chunks as soon as all chunks before them
+ * have been written (or as soon as they arrive for unordered output). After a write error, chunks are discarded so that the
+ * workers do not block.
+ */
+void OutputBuffer::write_chunks() {
+    std::vector<std::string> ready;
     while (true) {
-        const auto& item = chunks.find(next_chunk_index);
-        if (item == chunks.end()) {
+        std::unique_lock<std::mutex> unique_lock(mtx);
+        cv_chunk.wait(unique_lock, [&]{ return has_chunk_to_write() || closing; });
+        ready.clear();
+        while (!unordered_chunks.empty()) {
+            ready.push_back(std::move(unordered_chunks.front()));
+            unordered_chunks.pop_front();
+        }
+        while (ordered && filled[next_chunk_index % window.size()]) {
+            size_t slot = next_chunk_index % window.size();
+            ready.push_back(std::move(window[slot]));
+            window[slot] = std::string();
+            filled[slot] = false;
+            n_buffered--;
+            next_chunk_index++;
+        }
+        bool failed = bool(error);
+        unique_lock.unlock();
+        cv_space.notify_all();
+        if (ready.empty()) {
+            // closing, and all chunks have been written
             break;
         }
-        out << item->second;
-        chunks.erase(item);
-        next_chunk_index++;
+        if (failed) {
+            continue;
+        }
+        Timer write_timer;
+        try {
+            write_fully(fd, ready);
+        } catch (...) {
+            unique_lock.lock();
+            error = std::current_exception();
+            unique_lock.unlock();
+        }
+        unique_lock.lock();
+        stats.write_time += write_timer.duration();
+    }
+}
+
+void OutputBuffer::close() {
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        closing = true;
+    }
+    cv_chunk.notify_all();
+    writer.join();
+    if (error) {
+        std::rethrow_exception(error);
     }
-    unique_lock.unlock();
+}
+
+OutputBuffer::Statistics OutputBuffer::statistics() {
+    std::lock_guard<std::mutex> lock(mtx);
+    return stats;
 }
 
 
 void perform_task(
-    InputBuffer &input_buffer,
+    BatchQueue &batch_queue,
     OutputBuffer &output_buffer,
     AlignmentStatistics& statistics,
     int& done,
@@ -120,27 +379,80 @@ void perform_task(
     bool eof = false;
 //    Aligner aligner{aln_params};
     int temp_index = 0;
+    QueryBuffers buffers;
+    NamFileChunk binary_chunk;
+    std::optional<BgzfCompressor> compressor;
+    if (map_param.compress_output) {
+        compressor.emplace();
+    }
     while (!eof) {
         temp_index += 1;
 //        std::vector<klibpp::KSeq> records1;
 //        std::vector<klibpp::KSeq> records2;
-        std::vector<klibpp::KSeq> records3;
-        auto chunk_index = input_buffer.read_records(records3);
-//        assert(records1.size() == records2.size());
-//        i_dist_est isize_est;
-        if ( records3.empty()
-                && input_buffer.finished_reading){
+        Timer read_timer;
+        size_t batch_index;
+        if (!batch_queue.pop(batch_index)) {
             break;
         }
+        statistics.tot_read_file += read_timer.duration();
+        const ReadBatch& batch = batch_queue.batch(batch_index).reads;
+        auto chunk_index = batch_queue.batch(batch_index).chunk_index;
+//        assert(records1.size() == records2.size());
+//        i_dist_est isize_est;
 
         std::string nam_out;
-        nam_out.reserve(100 * (2* records3.size()));
-        for (size_t i = 0; i < records3.size(); ++i) {
-            auto record = records3[i];
-            align_SE_read(record, nam_out, statistics, map_param, index_parameters, references, index);
+        if (map_param.binary_output) {
+            binary_chunk.clear(batch_queue.batch(batch_index).first_read_index);
+            for (size_t i = 0; i < batch.size(); ++i) {
+                auto record = batch[i];
+                find_read_nams(record, statistics, map_param, index_parameters, index, buffers);
+                binary_chunk.add(record.name, record.seq.size(), buffers.nams);
+            }
+            binary_chunk.append_to(nam_out);
+        } else {
+            nam_out.reserve(100 * (2* batch.size()));
+            for (size_t i = 0; i < batch.size(); ++i) {
+                align_SE_read(batch[i], nam_out, statistics, map_param, index_parameters, references, index, buffers);
+            }
+        }
+        batch_queue.put_empty(batch_index);
+        if (compressor) {
+            // Compress here so that the writer thread only writes
+            std::string compressed;
+            compressor->compress(compressed, nam_out);
+            nam_out = std::move(compressed);
         }
         output_buffer.output_records(std::move(nam_out), chunk_index);
         assert(nam_out == "");
     }
     done = true;
 }
+
+void map_reads(
+    InputBuffer& input_buffer,
+    BatchQueue& batch_queue,
+    OutputBuffer& output_buffer,
+    std::vector<AlignmentStatistics>& statistics,
+    const mapping_params &map_param,
+    const IndexParameters& index_parameters,
+    const References& references,
+    const StrobemerIndex& index
+) {
+    std::thread reader(read_batches, std::ref(input_buffer), std::ref(batch_queue));
+
+    std::vector<std::thread> workers;
+    std::vector<int> worker_done(statistics.size());  // each thread sets its entry to 1 when it’s done
+    for (size_t i = 0; i < statistics.size(); ++i) {
+        std::thread consumer(perform_task, std::ref(batch_queue), std::ref(output_buffer),
+            std::ref(statistics[i]), std::ref(worker_done[i]),
+            std::ref(map_param), std::ref(index_parameters), std::ref(references),
+            std::ref(index));
+        workers.push_back(std::move(consumer));
+    }
+
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    reader.join();
+    batch_queue.check_error();
+}
@@ -10,20 +10,27 @@
 #include <queue>
 #include <vector>
 #include <sstream>
-#include <unordered_map>
+#include <deque>
+#include <map>
 #include <optional>
+#include <exception>
 
 #include "index.hpp"
 #include "aln.hpp"
 #include "refs.hpp"
 #include "fastq.hpp"
+#include "readbatch.hpp"
 
 class InputBuffer {
 
 public:
 
-    InputBuffer(std::string fname1, int chunk_size)
-    : ks1(open_fastq(fname1)),
+    InputBuffer(std::string fname1, int chunk_size, size_t n_threads = 1)
+    : ks1(open_fastq(fname1, n_threads)),
+    chunk_size(chunk_size) { }
+
+    InputBuffer(input_stream_t input, int chunk_size)
+    : ks1(std::move(input)),
     chunk_size(chunk_size) { }
 
     std::mutex mtx;
@@ -31,33 +38,161 @@ public:
     input_stream_t ks1;
     input_stream_t ks2;
     std::optional<klibpp::KSeq> lookahead1;
+    // Parsed into by read_records, reused to avoid allocating per record
+    klibpp::KSeq record;
     bool finished_reading{false};
     int chunk_size;
     size_t chunk_index{0};
     bool is_interleaved{false};
 
     void rewind_reset();
-    size_t read_records(std::vector<klibpp::KSeq> &records3,
+    size_t read_records(ReadBatch &batch,
             int read_count=-1);
 };
 
 
+/*
+ * A fixed number of read batches that are passed from a reader thread to
+ * the worker threads and back. The reader fills empty batches and queues
+ * them; workers take queued batches and return them empty once processed.
+ * Since no more batches exist, the reader is at most that many batches
+ * ahead of the workers.
+ */
+class BatchQueue {
+
+public:
+    BatchQueue(size_t n_batches) : batches(n_batches) {
+        for (size_t i = 0; i < n_batches; ++i) {
+            empty_batches.push(i);
+        }
+    }
+
+    struct Batch {
+        ReadBatch reads;
+        size_t chunk_index{0};
+        uint64_t first_read_index{0};  // index of the first read in the input
+    };
+
+    // Statistics on the number of queued batches
+    struct Statistics {
+        size_t n_batches{0};
+        size_t n_reads{0};
+        size_t n_popped{0};
+        size_t sum_queued{0};  // sum over pop() calls of the number of queued batches
+        size_t n_worker_waits{0};  // pop() calls that had to wait for the reader
+        size_t n_reader_waits{0};  // get_empty() calls that had to wait for workers
+
+        double average_queued() const {
+            return n_popped > 0 ? double(sum_queued) / n_popped : 0;
+        }
+    };
+
+    Batch& batch(size_t i) {
+        return batches[i];
+    }
+
+    // Reader side
+    size_t get_empty();
+    void push(size_t i);
+    void close(std::exception_ptr error = nullptr);
+
+    // Worker side. pop() returns false if all batches have been processed.
+    bool pop(size_t& i);
+    void put_empty(size_t i);
+
+    Statistics statistics();
+    // Rethrow an exception that ended reading, if any
+    void check_error();
+
+private:
+    std::mutex mtx;
+    std::condition_variable cv_empty;
+    std::condition_variable cv_queued;
+    std::vector<Batch> batches;
+    std::queue<size_t> empty_batches;
+    std::queue<size_t> queued_batches;
+    bool closed{false};
+    std::exception_ptr error;
+    Statistics stats;
+};
+
+void read_batches(InputBuffer& input_buffer, BatchQueue& queue);
+
+
+/*
+ * Writes chunks of output to a file descriptor in the order of their chunk
+ * indices. Writing is done by a writer thread. Chunks that arrive before
+ * their turn wait in a reorder window of window_size chunks; a worker whose
+ * chunk does not fit into the window yet blocks until it does.
+ *
+ * If ordered is false, chunks are written in the order in which they arrive,
+ * and at most window_size chunks wait for the writer.
+ */
 class OutputBuffer {
 
 public:
-    OutputBuffer(std::ostream& out) : out(out) { }
+    OutputBuffer(int fd, size_t window_size, bool ordered = true);
+    ~OutputBuffer();
+
+    struct Statistics {
+        size_t max_buffered{0};  // largest number of chunks waiting to be written
+        size_t n_worker_waits{0};  // output_records() calls that waited for space
+        std::chrono::duration<double> write_time{0};
+
+        // Chunks that arrived before a chunk with a smaller index. For
+        // unordered output, these would have had to wait in the reorder
+        // window for ordered output.
+        size_t n_early_chunks{0};
+        // Largest number (and total size) of chunks that ordered output would
+        // have held back at the same time
+        size_t max_early_chunks{0};
+        size_t max_early_bytes{0};
+    };
 
+    void output_records(std::string chunk, size_t chunk_index);
+    // Write the remaining chunks and stop the writer thread. Throws if
+    // writing failed.
+    void close();
+    Statistics statistics();
+
+private:
+    void write_chunks();
+    bool has_chunk_to_write() const;
+    void record_arrival(size_t chunk_index, size_t size);
+
+    const int fd;
+    const bool ordered;
     std::mutex mtx;
-    std::ostream &out;
-    std::unordered_map<size_t, std::string> chunks;
+    std::condition_variable cv_chunk;
+    std::condition_variable cv_space;
+    std::vector<std::string> window;
+    std::vector<bool> filled;
+    std::deque<std::string> unordered_chunks;
+    size_t n_buffered{0};
+    // For the statistics: chunks that arrived early (index to size)
+    std::map<size_t, size_t> early_chunks;
+    size_t early_bytes{0};
+    size_t next_arriving_index{0};
     size_t next_chunk_index{0};
-
-    void output_records(std::string chunk, size_t chunk_index);
+    bool closing{false};
+    std::exception_ptr error;
+    Statistics stats;
+    std::thread writer;
 };
 
 
-void perform_task(InputBuffer &input_buffer, OutputBuffer &output_buffer,
+void perform_task(BatchQueue &batch_queue, OutputBuffer &output_buffer,
                   AlignmentStatistics& statistics, int& done,
                   const mapping_params &map_param, const IndexParameters& index_parameters, const References& references, const StrobemerIndex& index);
 
+/*
+ * Find the NAMs of all reads in the input and pass them to output_buffer.
+ * A reader thread parses the input into the batches of batch_queue, and
+ * one worker thread per entry of statistics processes them. Throws if
+ * reading the input failed.
+ */
+void map_reads(InputBuffer& input_buffer, BatchQueue& batch_queue, OutputBuffer& output_buffer,
+               std::vector<AlignmentStatistics>& statistics,
+               const mapping_params &map_param, const IndexParameters& index_parameters, const References& references, const StrobemerIndex& index);
+
 #endif
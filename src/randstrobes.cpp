@@ -108,6 +108,70 @@ Syncmer SyncmerIterator::next() {
     return Syncmer{0, 0}; // end marker
 }
 
+/*
+ * Return the first position p >= start at which a SyncmerIterator created
+ * with that start position is guaranteed to produce the same syncmers as one
+ * that started at the beginning of seq.
+ *
+ * The iterator state at a k-mer only depends on earlier sequence through the
+ * tie-breaking between equal s-mer minima. It is therefore independent of
+ * history if the k-mer at p contains a non-ACGT character (the state is reset
+ * there) or if its smallest canonical s-mer is unique.
+ *
+ * Returns seq.length() if there is no such position.
+ */
+size_t find_syncmer_resync_position(std::string_view seq, size_t start, size_t k, size_t s) {
+    const uint64_t smask = (1ULL << 2*s) - 1;
+    const uint64_t sshift = (s - 1) * 2;
+    for (size_t p = start; p + k <= seq.length(); ++p) {
+        uint64_t xs[2] = {0, 0};
+        uint64_t min_val = UINT64_MAX;
+        size_t min_count = 0;
+        bool has_n = false;
+        for (size_t j = p; j < p + k; ++j) {
+            int c = seq_nt4_table[(uint8_t) seq[j]];
+            if (c >= 4) {
+                has_n = true;
+                break;
+            }
+            xs[0] = (xs[0] << 2 | c) & smask;
+            xs[1] = xs[1] >> 2 | (uint64_t)(3 - c) << sshift;
+            if (j + 1 < p + s) {
+                continue;
+            }
+            uint64_t ys = std::min(xs[0], xs[1]);
+            if (ys < min_val) {
+                min_val = ys;
+                min_count = 1;
+            } else if (ys == min_val) {
+                min_count++;
+            }
+        }
+        if (has_n || min_count == 1) {
+            return p;
+        }
+    }
+    return seq.length();
+}
+
+/*
+ * Append the syncmers of seq at positions in [start, end) to string_hashes
+ * and pos_to_seq_coordinate. start must be a position returned by
+ * find_syncmer_resync_position, so that the syncmers are the same as those
+ * found when processing seq from the beginning.
+ */
+void add_syncmers_in_range(
+    std::string_view seq, size_t k, size_t s, size_t t, size_t start, size_t end,
+    std::vector<syncmer_hash_t>& string_hashes, std::vector<unsigned int>& pos_to_seq_coordinate
+) {
+    SyncmerIterator syncmer_iterator{seq, k, s, t, start};
+    Syncmer syncmer;
+    while (!(syncmer = syncmer_iterator.next()).is_end() && syncmer.position < end) {
+        string_hashes.push_back(syncmer.hash);
+        pos_to_seq_coordinate.push_back(syncmer.position);
+    }
+}
+
 std::pair<std::vector<syncmer_hash_t>, std::vector<unsigned int>> make_string_to_hashvalues_open_syncmers_canonical(
     const std::string &seq,
     const size_t k,
@@ -195,43 +259,71 @@ Randstrobe RandstrobeIterator2::next() {
  * syncmers. Since creating canonical syncmers is the most time consuming step,
  * we avoid performing it twice for the read and its reverse complement here.
  */
-QueryRandstrobeVector randstrobes_query(
+/*
+ * Append the query randstrobes whose first strobe is one of the syncmers
+ * first, ..., last - 1 to randstrobes. For reverse-complement randstrobes,
+ * string_hashes and pos_to_seq_coordinate describe the syncmers of the
+ * reverse complement.
+ */
+void add_query_randstrobes(
+    const std::vector<syncmer_hash_t>& string_hashes,
+    const std::vector<unsigned int>& pos_to_seq_coordinate,
+    unsigned w_min,
+    unsigned w_max,
+    int max_dist,
+    int k,
+    unsigned int first,
+    unsigned int last,
+    bool is_reverse,
+    QueryRandstrobeVector& randstrobes
+) {
+    RandstrobeIterator randstrobe_iter { string_hashes, pos_to_seq_coordinate, w_min, w_max, max_dist, first };
+    while (randstrobe_iter.has_next() && randstrobe_iter.next_index() < last) {
+        auto randstrobe = randstrobe_iter.next();
+        randstrobes.push_back(
+            QueryRandstrobe{randstrobe.hash, randstrobe.strobe1_pos, randstrobe.strobe2_pos + k, is_reverse}
+        );
+    }
+}
+
+/*
+ * Compute the randstrobes of the query in both orientations, which replace
+ * the contents of randstrobes. string_hashes and pos_to_seq_coordinate are
+ * used as buffers for the syncmers.
+ */
+void randstrobes_query(
     int k,
     unsigned w_min,
     unsigned w_max,
-    const std::string& seq,
+    std::string_view seq,
     int s,
     int t,
-    int max_dist
+    int max_dist,
+    QueryRandstrobeVector& randstrobes,
+    std::vector<syncmer_hash_t>& string_hashes,
+    std::vector<unsigned int>& pos_to_seq_coordinate
 ) {
     // this function differs from  the function seq_to_randstrobes2 which creating randstrobes for the reference.
     // The seq_to_randstrobes2 stores randstobes only in one direction from canonical syncmers.
     // this function stores randstobes from both directions created from canonical syncmers.
     // Since creating canonical syncmers is the most time consuming step, we avoid perfomring it twice for the read and its RC here
-    QueryRandstrobeVector randstrobes2;
+    randstrobes.clear();
     auto read_length = seq.length();
     if (read_length < w_max) {
-        return randstrobes2;
+        return;
     }
 
     // make string of strobes into hashvalues all at once to avoid repetitive k-mer to hash value computations
-    std::vector<uint64_t> string_hashes;
-    std::vector<unsigned int> pos_to_seq_coordinate;
-
-    std::tie(string_hashes, pos_to_seq_coordinate) = make_string_to_hashvalues_open_syncmers_canonical(seq, k, s, t);
+    string_hashes.clear();
+    pos_to_seq_coordinate.clear();
+    add_syncmers_in_range(seq, k, s, t, 0, read_length, string_hashes, pos_to_seq_coordinate);
 
     unsigned int nr_hashes = string_hashes.size();
     if (nr_hashes == 0) {
-        return randstrobes2;
+        return;
     }
 
-    RandstrobeIterator randstrobe_fwd_iter { string_hashes, pos_to_seq_coordinate, w_min, w_max, max_dist };
-    while (randstrobe_fwd_iter.has_next()) {
-        auto randstrobe = randstrobe_fwd_iter.next();
-        randstrobes2.push_back(
-            QueryRandstrobe{randstrobe.hash, randstrobe.strobe1_pos, randstrobe.strobe2_pos + k, false}
-        );
-    }
+    add_query_randstrobes(string_hashes, pos_to_seq_coordinate, w_min, w_max, max_dist, k, 0, nr_hashes, false, randstrobes);
 
     std::reverse(string_hashes.begin(), string_hashes.end());
     std::reverse(pos_to_seq_coordinate.begin(), pos_to_seq_coordinate.end());
@@ -239,12 +331,21 @@ QueryRandstrobeVector randstrobes_query(
         pos_to_seq_coordinate[i] = read_length - pos_to_seq_coordinate[i] - k;
     }
 
-    RandstrobeIterator randstrobe_rc_iter { string_hashes, pos_to_seq_coordinate, w_min, w_max, max_dist };
-    while (randstrobe_rc_iter.has_next()) {
-        auto randstrobe = randstrobe_rc_iter.next();
-        randstrobes2.push_back(
-            QueryRandstrobe{randstrobe.hash, randstrobe.strobe1_pos, randstrobe.strobe2_pos + k, true}
-        );
-    }
-    return randstrobes2;
+    add_query_randstrobes(string_hashes, pos_to_seq_coordinate, w_min, w_max, max_dist, k, 0, nr_hashes, true, randstrobes);
+}
+
+QueryRandstrobeVector randstrobes_query(
+    int k,
+    unsigned w_min,
+    unsigned w_max,
+    std::string_view seq,
+    int s,
+    int t,
+    int max_dist
+) {
+    QueryRandstrobeVector randstrobes;
+    std::vector<syncmer_hash_t> string_hashes;
+    std::vector<unsigned int> pos_to_seq_coordinate;
+    randstrobes_query(k, w_min, w_max, seq, s, t, max_dist, randstrobes, string_hashes, pos_to_seq_coordinate);
+    return randstrobes;
 }
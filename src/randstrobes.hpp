@@ -3,6 +3,7 @@
 
 #include <vector>
 #include <string>
+#include <string_view>
 #include <tuple>
 #include <deque>
 #include <algorithm>
@@ -34,7 +35,27 @@ struct QueryRandstrobe {
 
 using QueryRandstrobeVector = std::vector<QueryRandstrobe>;
 
-QueryRandstrobeVector randstrobes_query(int k, unsigned w_min, unsigned w_max, const std::string &seq, int s, int t, int max_dist);
+QueryRandstrobeVector randstrobes_query(int k, unsigned w_min, unsigned w_max, std::string_view seq, int s, int t, int max_dist);
+
+void randstrobes_query(
+    int k, unsigned w_min, unsigned w_max, std::string_view seq, int s, int t, int max_dist,
+    QueryRandstrobeVector& randstrobes,
+    std::vector<syncmer_hash_t>& string_hashes,
+    std::vector<unsigned int>& pos_to_seq_coordinate
+);
+
+void add_query_randstrobes(
+    const std::vector<syncmer_hash_t>& string_hashes,
+    const std::vector<unsigned int>& pos_to_seq_coordinate,
+    unsigned w_min,
+    unsigned w_max,
+    int max_dist,
+    int k,
+    unsigned int first,
+    unsigned int last,
+    bool is_reverse,
+    QueryRandstrobeVector& randstrobes
+);
 
 struct Randstrobe {
     randstrobe_hash_t hash;
@@ -59,12 +80,14 @@ public:
         const std::vector<unsigned int> &pos_to_seq_coordinate,
         unsigned w_min,
         unsigned w_max,
-        int max_dist
+        int max_dist,
+        unsigned int start = 0
     ) : string_hashes(string_hashes)
       , pos_to_seq_coordinate(pos_to_seq_coordinate)
       , w_min(w_min)
       , w_max(w_max)
       , max_dist(max_dist)
+      , strobe1_start(start)
     {
         if (w_min > w_max) {
             throw std::invalid_argument("w_min is greater than w_max");
@@ -79,6 +102,11 @@ public:
         return strobe1_start + w_min < string_hashes.size();
     }
 
+    // Index of the syncmer that is the first strobe of the next randstrobe
+    unsigned int next_index() const {
+        return strobe1_start;
+    }
+
 private:
     Randstrobe get(unsigned int strobe1_start) const;
     const std::vector<uint64_t> &string_hashes;
@@ -101,13 +129,13 @@ std::ostream& operator<<(std::ostream& os, const Syncmer& syncmer);
 
 class SyncmerIterator {
 public:
-    SyncmerIterator(const std::string& seq, size_t k, size_t s, size_t t)
-        : seq(seq), k(k), s(s), t(t) { }
+    SyncmerIterator(std::string_view seq, size_t k, size_t s, size_t t, size_t start = 0)
+        : seq(seq), k(k), s(s), t(t), i(start) { }
 
     Syncmer next();
 
 private:
-    const std::string& seq;
+    const std::string_view seq;
     const size_t k;
     const size_t s;
     const size_t t;
@@ -122,17 +150,18 @@ private:
     size_t l = 0;
     uint64_t xk[2] = {0, 0};
     uint64_t xs[2] = {0, 0};
-    size_t i = 0;
+    size_t i;
 };
 
 class RandstrobeIterator2 {
 public:
     RandstrobeIterator2(
-        const std::string& seq, size_t k, size_t s, size_t t,
+        std::string_view seq, size_t k, size_t s, size_t t,
         unsigned w_min,
         unsigned w_max,
-        int max_dist
-    ) : syncmer_iterator(SyncmerIterator(seq, k, s, t))
+        int max_dist,
+        size_t start = 0
+    ) : syncmer_iterator(SyncmerIterator(seq, k, s, t, start))
       , w_min(w_min)
       , w_max(w_max)
       , max_dist(max_dist)
@@ -150,6 +179,13 @@ private:
 };
 
 
+size_t find_syncmer_resync_position(std::string_view seq, size_t start, size_t k, size_t s);
+
+void add_syncmers_in_range(
+    std::string_view seq, size_t k, size_t s, size_t t, size_t start, size_t end,
+    std::vector<syncmer_hash_t>& string_hashes, std::vector<unsigned int>& pos_to_seq_coordinate
+);
+
 std::pair<std::vector<syncmer_hash_t>, std::vector<unsigned int>> make_string_to_hashvalues_open_syncmers_canonical(
     const std::string &seq,
     const size_t k,
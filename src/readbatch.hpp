@@ -0,0 +1,64 @@
+#ifndef READBATCH_HPP
+#define READBATCH_HPP
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include "kseq++.hpp"
+
+// Name and sequence of a read in a ReadBatch
+struct ReadRecord {
+    std::string_view name;
+    std::string_view seq;
+};
+
+/*
+ * A batch of reads whose names and sequences are stored one after another
+ * in a single buffer. Records refer to their parts by offset. A batch is
+ * meant to be cleared and refilled, so that no memory is allocated per read
+ * once the buffers are large enough.
+ */
+class ReadBatch {
+public:
+    void clear() {
+        data.clear();
+        offsets.clear();
+    }
+
+    void add(const klibpp::KSeq& record) {
+        size_t name_start = data.size();
+        data.append(record.name);
+        size_t seq_start = data.size();
+        data.append(record.seq);
+        offsets.push_back(Offsets{name_start, seq_start, data.size()});
+    }
+
+    size_t size() const {
+        return offsets.size();
+    }
+
+    bool empty() const {
+        return offsets.empty();
+    }
+
+    // The record is valid until the batch is modified
+    ReadRecord operator[](size_t i) const {
+        const auto& o = offsets[i];
+        std::string_view view{data};
+        return ReadRecord{
+            view.substr(o.name_start, o.seq_start - o.name_start),
+            view.substr(o.seq_start, o.seq_end - o.seq_start)
+        };
+    }
+
+private:
+    struct Offsets {
+        size_t name_start;
+        size_t seq_start;
+        size_t seq_end;
+    };
+    std::string data;
+    std::vector<Offsets> offsets;
+};
+
+#endif
@@ -33,6 +33,16 @@ public:
 
     static References from_fasta(const std::string& filename);
 
+    // References whose sequences are not needed, such as for writing output.
+    // The sequences are empty strings.
+    static References without_sequences(ref_names names, const std::vector<unsigned int>& lengths) {
+        std::vector<std::string> sequences(names.size());
+        References references(std::move(sequences), std::move(names));
+        references.lengths = lengths;
+        references._total_length = std::accumulate(lengths.begin(), lengths.end(), (size_t)0);
+        return references;
+    }
+
     size_t size() const {
         return sequences.size();
     }
@@ -0,0 +1,140 @@
+#include "server.hpp"
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "exceptions.hpp"
+#include "logger.hpp"
+#include "namfile.hpp"
+#include "pc.hpp"
+#include "timer.hpp"
+
+static Logger& logger = Logger::get();
+
+namespace {
+
+InvalidFile socket_error(const std::string& what, const std::string& socket_path) {
+    return InvalidFile(what + " " + socket_path + ": " + std::strerror(errno));
+}
+
+int listen_on(const std::string& socket_path) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        throw InvalidFile("Socket path is too long: " + socket_path);
+    }
+    std::strcpy(address.sun_path, socket_path.c_str());
+
+    // Remove a socket left behind by an earlier server, but nothing else
+    struct stat st;
+    if (stat(socket_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+        unlink(socket_path.c_str());
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        throw socket_error("Could not create socket", socket_path);
+    }
+    if (bind(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1) {
+        close(fd);
+        throw socket_error("Could not bind to socket", socket_path);
+    }
+    if (listen(fd, 64) == -1) {
+        close(fd);
+        throw socket_error("Could not listen on socket", socket_path);
+    }
+    return fd;
+}
+
+/*
+ * Shuts down reading from the connection when destroyed. This unblocks the
+ * thread that reads the request if it was not read to the end because of
+ * an error, so that the reader can be destroyed.
+ */
+struct ShutdownOnExit {
+    int fd;
+    ~ShutdownOnExit() {
+        shutdown(fd, SHUT_RD);
+    }
+};
+
+/* Find the NAMs of the reads sent over the connection and send them back */
+void handle_request(
+    int fd,
+    size_t request_index,
+    int n_threads,
+    int chunk_size,
+    const mapping_params& map_param,
+    const IndexParameters& index_parameters,
+    const References& references,
+    const StrobemerIndex& index
+) {
+    Timer request_timer;
+    if (map_param.binary_output) {
+        std::string header = nam_file_header(references);
+        if (send(fd, header.data(), header.size(), MSG_NOSIGNAL) != ssize_t(header.size())) {
+            throw InvalidFile(std::string("Could not send NAMs: ") + std::strerror(errno));
+        }
+    }
+
+    int input_fd = dup(fd);
+    std::FILE* input = input_fd == -1 ? nullptr : fdopen(input_fd, "rb");
+    if (input == nullptr) {
+        throw InvalidFile(std::string("Could not read request: ") + std::strerror(errno));
+    }
+    auto reader = std::make_unique<GzipReader>(input, "request " + std::to_string(request_index), n_threads);
+    InputBuffer input_buffer(std::make_unique<RewindableFile>(std::move(reader)), chunk_size);
+    input_buffer.rewind_reset();
+    ShutdownOnExit shutdown_on_exit{fd};
+
+    OutputBuffer output_buffer(fd, 4 * n_threads);
+    BatchQueue batch_queue(2 * n_threads);
+    std::vector<AlignmentStatistics> statistics(n_threads);
+    map_reads(input_buffer, batch_queue, output_buffer, statistics, map_param, index_parameters, references, index);
+    output_buffer.close();
+
+    AlignmentStatistics total;
+    for (auto& s : statistics) {
+        total += s;
+    }
+    logger.info() << "Request " << request_index << ": "
+        << batch_queue.statistics().n_reads << " reads in " << request_timer.elapsed() << " s"
+        << " (finding NAMs: " << total.tot_find_nams.count() / n_threads << " s)" << std::endl;
+}
+
+}  // namespace
+
+void serve(
+    const std::string& socket_path,
+    int n_threads,
+    int chunk_size,
+    const mapping_params& map_param,
+    const IndexParameters& index_parameters,
+    const References& references,
+    const StrobemerIndex& index
+) {
+    // A client that disconnects early must not terminate the server
+    std::signal(SIGPIPE, SIG_IGN);
+
+    int listen_fd = listen_on(socket_path);
+    logger.info() << "Listening on " << socket_path << std::endl;
+    for (size_t request_index = 1; ; ++request_index) {
+        int fd = accept(listen_fd, nullptr, nullptr);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            throw socket_error("Could not accept connection on", socket_path);
+        }
+        try {
+            handle_request(fd, request_index, n_threads, chunk_size, map_param, index_parameters, references, index);
+        } catch (const std::runtime_error& e) {
+            logger.error() << "Request " << request_index << " failed: " << e.what() << std::endl;
+        }
+        close(fd);
+    }
+}
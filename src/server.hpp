@@ -0,0 +1,29 @@
+#ifndef SERVER_HPP
+#define SERVER_HPP
+
+#include <string>
+#include "aln.hpp"
+#include "index.hpp"
+#include "indexparameters.hpp"
+#include "refs.hpp"
+
+/*
+ * Serve NAM requests on a Unix domain socket until the process is killed.
+ *
+ * A client connects, sends FASTA or FASTQ records (optionally gzip
+ * compressed) and then shuts down its side of the connection for writing.
+ * The NAMs are streamed back in the same format that the namfinder command
+ * writes, and the server closes the connection when they are complete.
+ * Requests are handled one after another, each by n_threads workers.
+ */
+void serve(
+    const std::string& socket_path,
+    int n_threads,
+    int chunk_size,
+    const mapping_params& map_param,
+    const IndexParameters& index_parameters,
+    const References& references,
+    const StrobemerIndex& index
+);
+
+#endif
@@ -0,0 +1,170 @@
+#include "sharedindex.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <unistd.h>
+#include "exceptions.hpp"
+
+namespace {
+
+// Marks a complete file; written last
+const char SHARED_INDEX_MAGIC[8] = {'N', 'A', 'M', 'S', 'H', 'M', '0', '1'};
+
+const uint64_t SHARED_INDEX_ALIGNMENT = 65536;
+
+struct Trailer {
+    uint64_t references_offset;
+    uint64_t references_size;
+    char magic[8];
+};
+
+uint64_t round_up(uint64_t value, uint64_t multiple) {
+    return (value + multiple - 1) / multiple * multiple;
+}
+
+std::string serialize_references(const References& references) {
+    std::string data;
+    uint64_t n_references = references.size();
+    data.append(reinterpret_cast<const char*>(&n_references), sizeof(n_references));
+    for (size_t i = 0; i < references.size(); ++i) {
+        uint32_t lengths[2] = {references.lengths[i], uint32_t(references.names[i].size())};
+        data.append(reinterpret_cast<const char*>(lengths), sizeof(lengths));
+        data.append(references.names[i]);
+    }
+    return data;
+}
+
+} // namespace
+
+SharedIndex::SharedIndex(const std::string& name) {
+    if (name.find('/') == std::string::npos) {
+        file_path = "/dev/shm/" + name;
+    } else {
+        file_path = name;
+    }
+    fd = open(file_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        throw InvalidIndexFile("Could not open shared index " + file_path + ": " + strerror(errno));
+    }
+    while (flock(fd, LOCK_EX) == -1) {
+        if (errno != EINTR) {
+            int err = errno;
+            close(fd);
+            throw InvalidIndexFile("Could not lock shared index " + file_path + ": " + strerror(err));
+        }
+    }
+    locked = true;
+}
+
+SharedIndex::~SharedIndex() {
+    unlock();
+    close(fd);
+}
+
+void SharedIndex::unlock() {
+    if (locked) {
+        flock(fd, LOCK_UN);
+        locked = false;
+    }
+}
+
+bool SharedIndex::is_published() const {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || uint64_t(st.st_size) < sizeof(Trailer)) {
+        return false;
+    }
+    Trailer trailer;
+    read_exactly(&trailer, sizeof(trailer), st.st_size - sizeof(trailer));
+    return std::memcmp(trailer.magic, SHARED_INDEX_MAGIC, sizeof(SHARED_INDEX_MAGIC)) == 0;
+}
+
+/*
+ * The file is written through a memory mapping since files on hugetlbfs
+ * do not support write(2). Its size is rounded up to the block size of the
+ * file system, which is the huge page size on hugetlbfs.
+ */
+void SharedIndex::publish(const StrobemerIndex& index, const References& references) {
+    std::string references_data = serialize_references(references);
+    uint64_t references_offset = round_up(index.serialized_size(), SHARED_INDEX_ALIGNMENT);
+    struct statfs fs;
+    if (fstatfs(fd, &fs) == -1) {
+        throw InvalidIndexFile("Could not write shared index " + file_path + ": " + strerror(errno));
+    }
+    uint64_t size = round_up(references_offset + references_data.size() + sizeof(Trailer), fs.f_bsize);
+
+    // Truncating first discards an incomplete index from an aborted run
+    if (ftruncate(fd, 0) == -1 || ftruncate(fd, size) == -1) {
+        throw InvalidIndexFile("Could not resize shared index " + file_path + ": " + strerror(errno));
+    }
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        throw InvalidIndexFile("Could not map shared index " + file_path + ": " + strerror(errno));
+    }
+    char* data = static_cast<char*>(addr);
+    index.write(data);
+    std::memcpy(data + references_offset, references_data.data(), references_data.size());
+    Trailer trailer{references_offset, references_data.size(), {}};
+    std::memcpy(trailer.magic, SHARED_INDEX_MAGIC, sizeof(SHARED_INDEX_MAGIC));
+    std::memcpy(data + size - sizeof(trailer), &trailer, sizeof(trailer));
+    munmap(addr, size);
+}
+
+References SharedIndex::references() const {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        throw InvalidIndexFile("Could not read shared index " + file_path + ": " + strerror(errno));
+    }
+    Trailer trailer;
+    read_exactly(&trailer, sizeof(trailer), st.st_size - sizeof(trailer));
+    if (trailer.references_offset + trailer.references_size > uint64_t(st.st_size) - sizeof(trailer)) {
+        throw InvalidIndexFile("Shared index " + file_path + " is corrupt");
+    }
+    std::string data(trailer.references_size, '\0');
+    read_exactly(data.data(), data.size(), trailer.references_offset);
+
+    uint64_t n_references;
+    size_t pos = 0;
+    if (data.size() < sizeof(n_references)) {
+        throw InvalidIndexFile("Shared index " + file_path + " is corrupt");
+    }
+    std::memcpy(&n_references, data.data(), sizeof(n_references));
+    pos += sizeof(n_references);
+    std::vector<std::string> names;
+    std::vector<unsigned int> lengths;
+    for (uint64_t i = 0; i < n_references; ++i) {
+        uint32_t header[2];
+        if (pos + sizeof(header) > data.size()) {
+            throw InvalidIndexFile("Shared index " + file_path + " is corrupt");
+        }
+        std::memcpy(header, data.data() + pos, sizeof(header));
+        pos += sizeof(header);
+        if (pos + header[1] > data.size()) {
+            throw InvalidIndexFile("Shared index " + file_path + " is corrupt");
+        }
+        lengths.push_back(header[0]);
+        names.emplace_back(data.data() + pos, header[1]);
+        pos += header[1];
+    }
+    return References::without_sequences(std::move(names), lengths);
+}
+
+void SharedIndex::read_exactly(void* buffer, size_t length, uint64_t offset) const {
+    auto p = static_cast<char*>(buffer);
+    while (length > 0) {
+        ssize_t n = pread(fd, p, length, offset);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            throw InvalidIndexFile("Could not read shared index " + file_path);
+        }
+        p += n;
+        length -= n;
+        offset += n;
+    }
+}
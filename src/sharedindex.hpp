@@ -0,0 +1,55 @@
+#ifndef SHAREDINDEX_HPP
+#define SHAREDINDEX_HPP
+
+#include <string>
+#include "index.hpp"
+#include "refs.hpp"
+
+/*
+ * An index that is built once and then shared by all namfinder processes
+ * on a node through a file in memory: a POSIX shared memory object in
+ * /dev/shm or a file on a hugetlbfs mount.
+ *
+ * The file contains the index in .sti format, followed by the names and
+ * lengths of the references and a trailer that marks the file as complete.
+ * Processes map the index read-only, so its pages exist only once in
+ * memory, and they do not need to read the reference FASTA.
+ *
+ * The constructor locks the file, so that only one process builds the
+ * index while the others wait for it to be published.
+ */
+class SharedIndex {
+public:
+    // A name without a slash is a shared memory object in /dev/shm; anything
+    // else is the path of a file, for example on a hugetlbfs mount
+    explicit SharedIndex(const std::string& name);
+    ~SharedIndex();
+    SharedIndex(const SharedIndex&) = delete;
+    SharedIndex& operator=(const SharedIndex&) = delete;
+
+    // Whether an earlier process has already published an index
+    bool is_published() const;
+
+    // Write the index and the reference names and lengths into the file
+    void publish(const StrobemerIndex& index, const References& references);
+
+    // Release the lock so that other processes can use the published index
+    void unlock();
+
+    // The references of the published index (without sequences)
+    References references() const;
+
+    // Path of the file, for StrobemerIndex::read
+    const std::string& path() const {
+        return file_path;
+    }
+
+private:
+    void read_exactly(void* buffer, size_t length, uint64_t offset) const;
+
+    std::string file_path;
+    int fd{-1};
+    bool locked{false};
+};
+
+#endif
@@ -8,6 +8,9 @@
 #include "tmpdir.hpp"
 #include "io.hpp"
 #include "revcomp.hpp"
+#include "nam.hpp"
+#include "readbatch.hpp"
+#include "namfinder.hpp"
 
 
 TEST_CASE("estimate_read_length") {
@@ -49,6 +52,20 @@ TEST_CASE("Parameters in sti file do not match") {
     REQUIRE_THROWS_AS(other_index.read(sti_path), InvalidIndexFile);
 }
 
+TEST_CASE("External index construction gives same hashes as in-memory construction") {
+    auto references = References::from_fasta("tests/phix.fasta");
+    IndexParameters parameters(20, 16, 0, 7, 255, 1000);
+    StrobemerIndex index(references, parameters);
+    index.populate(1000, 2);
+    StrobemerIndex external_index(references, parameters);
+    external_index.populate(1000, 2, 16 * 1024);
+
+    REQUIRE(index.size() == external_index.size());
+    for (size_t i = 0; i < index.size(); ++i) {
+        CHECK(index.get_hash(i) == external_index.get_hash(i));
+    }
+}
+
 TEST_CASE("Missing sti file") {
     TemporaryDirectory tmp_dir;
     auto references = References::from_fasta("tests/phix.fasta");
@@ -103,6 +120,88 @@ TEST_CASE("both randstrobes iterator implementations give same results") {
     }
 }
 
+TEST_CASE("SyncmerIterator started at resync position gives same syncmers") {
+    auto references = References::from_fasta("tests/phix.fasta");
+    auto& seq = references.sequences[0];
+    std::string repetitive_seq = seq.substr(0, 1000) + std::string(200, 'A') + seq.substr(1000);
+    IndexParameters parameters(20, 16, 0, 7, 255, 1000);
+
+    for (size_t start : {0, 500, 1010, 1100, 3000}) {
+        auto resync = find_syncmer_resync_position(repetitive_seq, start, parameters.k, parameters.s);
+        SyncmerIterator full{repetitive_seq, size_t(parameters.k), size_t(parameters.s), size_t(parameters.t_syncmer)};
+        SyncmerIterator partial{repetitive_seq, size_t(parameters.k), size_t(parameters.s), size_t(parameters.t_syncmer), resync};
+        Syncmer syncmer;
+        while (!(syncmer = full.next()).is_end() && syncmer.position < resync) {
+        }
+        while (!syncmer.is_end()) {
+            auto other = partial.next();
+            CHECK(syncmer.hash == other.hash);
+            CHECK(syncmer.position == other.position);
+            syncmer = full.next();
+        }
+        CHECK(partial.next().is_end());
+    }
+}
+
+TEST_CASE("NAMs of a query split into windows are those of the whole query") {
+    auto references = References::from_fasta("tests/phix.fasta");
+    IndexParameters parameters(20, 16, 0, 7, 255, 1000);
+    StrobemerIndex index(references, parameters);
+    index.populate(1000, 1);
+    auto& seq = references.sequences[0];
+
+    auto query_randstrobes = randstrobes_query(parameters.k, parameters.w_min, parameters.w_max, seq, parameters.s, parameters.t_syncmer, parameters.max_dist);
+    auto [fraction, nams] = find_nams(query_randstrobes, index);
+    auto [windowed_fraction, windowed_nams] = find_nams_windowed(seq, parameters, index, 1000, 0, 2);
+
+    CHECK(fraction == windowed_fraction);
+    REQUIRE(nams.size() == windowed_nams.size());
+    auto by_position = [](const Nam& a, const Nam& b) {
+        return std::tie(a.is_rc, a.query_s, a.ref_s) < std::tie(b.is_rc, b.query_s, b.ref_s);
+    };
+    std::sort(nams.begin(), nams.end(), by_position);
+    std::sort(windowed_nams.begin(), windowed_nams.end(), by_position);
+    for (size_t i = 0; i < nams.size(); ++i) {
+        CHECK(nams[i].query_s == windowed_nams[i].query_s);
+        CHECK(nams[i].query_e == windowed_nams[i].query_e);
+        CHECK(nams[i].ref_s == windowed_nams[i].ref_s);
+        CHECK(nams[i].ref_e == windowed_nams[i].ref_e);
+        CHECK(nams[i].n_hits == windowed_nams[i].n_hits);
+    }
+}
+
+TEST_CASE("ReadBatch") {
+    ReadBatch batch;
+    klibpp::KSeq record;
+    record.name = "read1";
+    record.seq = "ACGT";
+    batch.add(record);
+    record.name = "read2";
+    record.seq = "GGGGCC";
+    batch.add(record);
+
+    REQUIRE(batch.size() == 2);
+    CHECK(batch[0].name == "read1");
+    CHECK(batch[0].seq == "ACGT");
+    CHECK(batch[1].name == "read2");
+    CHECK(batch[1].seq == "GGGGCC");
+
+    batch.clear();
+    CHECK(batch.empty());
+}
+
+TEST_CASE("IndexHandle finds a NAM covering a substring of the reference") {
+    IndexParameters parameters(20, 16, 0, 7, 255, 1000);
+    auto handle = IndexHandle::build("tests/phix.fasta", parameters);
+    std::string query = handle.references().sequences[0].substr(1000, 200);
+
+    auto nams = handle.find_nams(query);
+    REQUIRE(!nams.empty());
+    CHECK(nams[0].ref_id == 0);
+    CHECK(!nams[0].is_rc);
+    CHECK(nams[0].ref_s - nams[0].query_s == 1000);
+}
+
 TEST_CASE("reverse complement") {
     CHECK(reverse_complement("") == "");
     CHECK(reverse_complement("A") == "T");